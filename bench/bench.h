@@ -0,0 +1,70 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <fcntl.h>
+
+#include "../term/term.h"
+#include "../term/simd.h"
+
+/*
+  Benchmarks and checks run the terminal core without a child or a
+  window: bytes go straight into the parser, replies to /dev/null.
+*/
+void term_vt_init(void);
+void term_line_alloc(struct term_t*);
+void term_line_resize(struct term_t*, int, int);
+void _term_read(struct term_t*, uint8_t*, int);
+
+static inline void
+bench_term(struct term_t *t, int row, int col) {
+    ZERO(*t);
+    t->mode = MODE_CURSOR;
+    t->pen.mode = CHAR_MODE_DEFAULT_FG | CHAR_MODE_DEFAULT_BG;
+    t->c.style = term_style_intern(t, &t->pen);
+    t->c.width = 1;
+    t->c.c = ' ';
+    t->row = row;
+    t->col = col;
+    t->bot = t->row-1;
+    t->str.max = STR_MAX;
+    t->hist.max = HIST_MAX;
+    t->hist.max_mem = HIST_MEM;
+    t->in.size = IN_SIZE;
+    t->out.size = OUT_SIZE;
+    term_vt_init();
+    simd_init();
+    ASSERT((t->tty = open("/dev/null", O_WRONLY | O_CLOEXEC)) >= 0);
+    term_line_alloc(t);
+}
+
+// Reads the tty from an unlinked file holding buf, so that term_read
+// gets the whole burst as fast as it asks for it, replies fail EBADF
+static inline void
+bench_tty(struct term_t *t, uint8_t *buf, long n) {
+    char path[] = "/tmp/zt-bench-XXXXXX";
+    long k, ret;
+    int fd;
+
+    ASSERT((fd = mkstemp(path)) >= 0);
+    for (k = 0; k < n; k += ret)
+        ASSERT((ret = write(fd, buf + k, n - k)) > 0);
+    close(fd);
+    close(t->tty);
+    ASSERT((t->tty = open(path, O_RDONLY | O_CLOEXEC)) >= 0);
+    unlink(path);
+}
+
+// A fixed pseudo random sequence, so that every run sees the same input
+static inline uint32_t
+bench_rand(uint32_t *s) {
+    *s = *s * 1103515245 + 12345;
+    return *s >> 8;
+}
+
+// Megabytes per second of n bytes in the time since start
+static inline double
+bench_mbs(long n, long start) {
+    return n / 1e6 / ((get_time() - start) / (double)SECOND);
+}
+
+#endif
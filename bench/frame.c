@@ -0,0 +1,109 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include "bench.h"
+
+/*
+  How long a frame waits for the parser. One thread reads a burst
+  through term_read under a lock the way xparse does, the other takes
+  the lock and a snapshot every LATENCY like xdraw. Reported is the time
+  from asking for the lock to the snapshot taken, with the lock held for
+  whole read batches and handed over between chunks like xparse_yield.
+*/
+#define BURST                   (16L<<20)
+#define LATENCY                 (10 * MILLISECOND)
+
+static struct {
+    struct term_t t;
+    pthread_mutex_t lock;
+    long n;
+    int waiting, done;
+} f = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static char *cjk[] = {"漢字", "日本語の", "テキスト", "中文", "한국어"};
+
+static long
+burst(uint8_t *buf) {
+    uint32_t s = 1;
+    long n = 0;
+    int x;
+
+    while (n < BURST - 512) {
+        for (x = 0; x < 150; x += 12)
+            n += sprintf((char*)buf + n, "\033[%d;%dm%s word ",
+                bench_rand(&s) % 2, 31 + bench_rand(&s) % 7,
+                cjk[bench_rand(&s) % LEN(cjk)]);
+        buf[n++] = '\r';
+        buf[n++] = '\n';
+    }
+    return n;
+}
+
+static void
+yield(struct term_t *t __unused) {
+    if (!__atomic_load_n(&f.waiting, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_unlock(&f.lock);
+    while (__atomic_load_n(&f.waiting, __ATOMIC_ACQUIRE))
+        sched_yield();
+    pthread_mutex_lock(&f.lock);
+}
+
+static void *
+parse(void *arg __unused) {
+    do {
+        pthread_mutex_lock(&f.lock);
+        term_read(&f.t);
+        pthread_mutex_unlock(&f.lock);
+    } while (term_pending(&f.t) || lseek(f.t.tty, 0, SEEK_CUR) < f.n);
+    __atomic_store_n(&f.done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void
+run(char *name, uint8_t *buf, long n, int handover) {
+    struct term_snap_t snap = {0};
+    struct timespec ts = to_timespec(LATENCY);
+    pthread_t parser;
+    long start, w, max = 0, sum = 0, frames = 0;
+
+    bench_term(&f.t, 50, 200);
+    bench_tty(&f.t, buf, n);
+    f.t.yield = handover ? yield : NULL;
+    f.n = n;
+    f.done = 0;
+    start = get_time();
+    ASSERT(!pthread_create(&parser, NULL, parse, NULL));
+    while (!__atomic_load_n(&f.done, __ATOMIC_ACQUIRE)) {
+        nanosleep(&ts, NULL);
+        w = get_time();
+        __atomic_add_fetch(&f.waiting, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_lock(&f.lock);
+        __atomic_sub_fetch(&f.waiting, 1, __ATOMIC_ACQ_REL);
+        term_snap(&f.t, &snap);
+        pthread_mutex_unlock(&f.lock);
+        w = get_time() - w;
+        max = MAX(max, w);
+        sum += w;
+        frames++;
+    }
+    pthread_join(parser, NULL);
+    printf("frame %-8s %6.2f ms max %6.2f ms mean, %ld frames, %.1f MB/s\n",
+        name, max / 1e6, sum / 1e6 / MAX(frames, 1), frames,
+        bench_mbs(n, start));
+    term_snap_free(&snap);
+    term_free(&f.t);
+}
+
+int
+main(void) {
+    uint8_t *buf;
+    long n;
+
+    ASSERT(buf = malloc(BURST));
+    n = burst(buf);
+    run("batch", buf, n, 0);
+    run("chunk", buf, n, 1);
+    free(buf);
+    return 0;
+}
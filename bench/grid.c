@@ -0,0 +1,46 @@
+#include "bench.h"
+
+/*
+  Row operations as full screen TUIs send them, on a 50x200 screen with
+  a background color set, so erased cells are not the default blank.
+  Each sequence is repeated and timed through the parser.
+*/
+#define OPS                     200000
+
+static struct {
+    char *name, *seq;
+} ops[] = {
+    {"EL", "\033[10;5H\033[K"},
+    {"ED", "\033[H\033[2J"},
+    {"ECH", "\033[10;1H\033[150X"},
+    {"ICH", "\033[10;1H\033[20@"},
+    {"DCH", "\033[10;1H\033[20P"},
+    {"REP", "\033[10;1Hx\033[190b"},
+    {"IL", "\033[5;1H\033[10L"},
+    {"DL", "\033[5;1H\033[10M"},
+};
+
+int
+main(void) {
+    struct term_t t;
+    uint8_t *buf;
+    long start;
+    int i, k, n, m;
+
+    for (i = 0; i < LEN(ops); i++) {
+        m = strlen(ops[i].seq);
+        ASSERT(buf = malloc(m * OPS));
+        for (k = 0, n = 0; k < OPS; k++, n += m)
+            memcpy(buf + n, ops[i].seq, m);
+        bench_term(&t, 50, 200);
+        _term_read(&t, (uint8_t*)"\033[44m", 5);
+        start = get_time();
+        for (k = 0; k < n; k += IN_CHUNK)
+            _term_read(&t, buf + k, MIN(IN_CHUNK, n - k));
+        printf("grid %-4s %8.0f ns/op\n", ops[i].name,
+            (get_time() - start) / (double)OPS);
+        term_free(&t);
+        free(buf);
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <termios.h>
+
+#if defined(__linux)
+#include <pty.h>
+#elif defined(__APPLE__)
+#include <util.h>
+#elif defined(__DragonFly__) || defined(__FreeBSD__)
+#include <libutil.h>
+#endif
+
+#include "bench.h"
+#include "../term/paste.h"
+
+/*
+  A large paste into a child that echoes it back, the way a shell at a
+  prompt does. One loop stands in for both zt threads: the selection is
+  put in PASTE_CHUNK slices like xpaste_pump reads the property, the
+  queue pumped, the echo read under its budget and a snapshot taken per
+  frame. Reported are the paste throughput and the longest time between
+  two pumps, which fails the run when it is over a frame: drawing and
+  keys would stall that long.
+*/
+#define PASTE                   (32L<<20)
+#define FRAME                   (10 * MILLISECOND)
+
+static int
+child(int slave, long n) {
+    struct termios tio;
+    static char buf[8192], out[16384];
+    long got = 0;
+    int ret, i, k;
+
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    while (got < n && (ret = read(slave, buf, sizeof(buf))) > 0) {
+        got += ret;
+        for (i = 0, k = 0; i < ret; i++) {
+            out[k++] = buf[i];
+            if (buf[i] == '\r')
+                out[k++] = '\n';
+        }
+        if (write(slave, out, k) != k)
+            return 1;
+    }
+    return 0;
+}
+
+static long
+text(uint8_t *buf) {
+    static char *words[] = {"for", "i", "in", "$(seq", "10);", "do", "echo",
+        "\"$i\";", "done", "#", "a", "pasted", "script", "line"};
+    uint32_t s = 1;
+    long n = 0;
+    int x;
+
+    while (n < PASTE - 128) {
+        for (x = 0; x < 72;)
+            x += sprintf((char*)buf + n + x, "%s ",
+                words[bench_rand(&s) % LEN(words)]);
+        n += x;
+        buf[n++] = '\n';
+    }
+    return n;
+}
+
+int
+main(void) {
+    struct term_t t;
+    struct term_paste_t q = {0};
+    struct term_snap_t snap = {0};
+    struct timespec ts = to_timespec(FRAME);
+    fd_set fds, wfds;
+    uint8_t *buf;
+    long n, put = 0, start, now, pumped, frame, gap = 0, over = 0;
+    int master, slave, fd;
+    pid_t pid;
+
+    ASSERT(buf = malloc(PASTE));
+    n = text(buf);
+    bench_term(&t, 50, 200);
+    close(t.tty);
+    ASSERT(openpty(&master, &slave, NULL, NULL, NULL) >= 0);
+    ASSERT((pid = fork()) != -1);
+    if (!pid) {
+        close(master);
+        _exit(child(slave, n));
+    }
+    close(slave);
+    t.tty = fd = master;
+    ASSERT(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) >= 0);
+
+    start = pumped = frame = get_time();
+    for (;;) {
+        if (put < n && q.n < PASTE_CHUNK) {
+            paste_put(&q, buf + put, MIN(PASTE_CHUNK, n - put), 0);
+            put += MIN(PASTE_CHUNK, n - put);
+        }
+        paste_pump(&t, &q);
+        now = get_time();
+        gap = MAX(gap, now - pumped);
+        over += now - pumped > FRAME;
+        pumped = now;
+
+        FD_ZERO(&fds);
+        FD_ZERO(&wfds);
+        FD_SET(fd, &fds);
+        if (term_write_pending(&t))
+            FD_SET(fd, &wfds);
+        if (!term_pending(&t) &&
+            pselect(fd+1, &fds, &wfds, NULL, &ts, NULL) < 0)
+            break;
+        // the pty reads EIO once the child is gone and it is drained
+        if ((FD_ISSET(fd, &fds) || term_pending(&t)) && term_read(&t) &&
+            !term_pending(&t))
+            break;
+        if (term_write_pending(&t))
+            term_write_flush(&t);
+        if (get_time() - frame >= FRAME) {
+            term_snap(&t, &snap);
+            frame = get_time();
+        }
+    }
+
+    printf("paste %8.1f MB/s %6.2f ms max between pumps, %ld over a frame\n",
+        bench_mbs(n, start), gap / 1e6, over);
+    waitpid(pid, NULL, 0);
+    term_snap_free(&snap);
+    paste_free(&q);
+    term_free(&t);
+    free(buf);
+    return over > 0;
+}
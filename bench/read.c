@@ -0,0 +1,84 @@
+#include "bench.h"
+
+/*
+  Parser throughput on a fixed corpus of each kind: plain ASCII log
+  lines, the same with SGR colors, 2-byte UTF-8 text and wide CJK text.
+  Input is fed in IN_CHUNK pieces like term_read does, then the same
+  burst goes through term_read itself from a file, budget included.
+*/
+#define CORPUS                  (8<<20)
+#define REPS                    5
+
+static char *words[] = {
+    "gcc", "-O2", "-c", "src/term.c", "-o", "build/term.o", "warning:",
+    "unused", "variable", "[100%]", "Linking", "CXX", "executable",
+    "make[2]:", "Leaving", "directory", "'/usr/src/zt'", "ok", "PASS",
+};
+static char *utf8[] = {
+    "привет", "мир", "ελληνικά", "κείμενο", "café", "naïve", "über",
+    "Größe", "ação", "żółć",
+};
+static char *cjk[] = {
+    "漢字", "日本語の", "テキスト", "中文", "字符", "한국어", "문자열",
+};
+
+static int
+corpus(uint8_t *buf, char **w, int nw, int color) {
+    uint32_t s = 1;
+    int n = 0, x;
+
+    while (n < CORPUS - 256) {
+        for (x = 0; x < 72;) {
+            if (color && bench_rand(&s) % 8 == 0)
+                n += sprintf((char*)buf + n, "\033[%dm",
+                    bench_rand(&s) % 2 ? 31 + bench_rand(&s) % 7 : 0);
+            x += sprintf((char*)buf + n, "%s ", w[bench_rand(&s) % nw]);
+            n += strlen((char*)buf + n);
+        }
+        buf[n++] = '\r';
+        buf[n++] = '\n';
+    }
+    return n;
+}
+
+static void
+run(char *name, uint8_t *buf, int n) {
+    struct term_t t;
+    double best = 0, tty = 0, mbs;
+    long start;
+    int i, r;
+
+    for (r = 0; r < REPS; r++) {
+        bench_term(&t, 50, 200);
+        start = get_time();
+        for (i = 0; i < n; i += IN_CHUNK)
+            _term_read(&t, buf + i, MIN(IN_CHUNK, n - i));
+        mbs = bench_mbs(n, start);
+        best = MAX(best, mbs);
+        term_free(&t);
+
+        bench_term(&t, 50, 200);
+        bench_tty(&t, buf, n);
+        start = get_time();
+        do
+            term_read(&t);
+        while (term_pending(&t) || lseek(t.tty, 0, SEEK_CUR) < n);
+        mbs = bench_mbs(n, start);
+        tty = MAX(tty, mbs);
+        term_free(&t);
+    }
+    printf("read %-8s %8.1f MB/s %8.1f MB/s term_read\n", name, best, tty);
+}
+
+int
+main(void) {
+    uint8_t *buf;
+
+    ASSERT(buf = malloc(CORPUS));
+    run("ascii", buf, corpus(buf, words, LEN(words), 0));
+    run("sgr", buf, corpus(buf, words, LEN(words), 1));
+    run("utf8", buf, corpus(buf, utf8, LEN(utf8), 0));
+    run("cjk", buf, corpus(buf, cjk, LEN(cjk), 0));
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include "bench.h"
+
+/*
+  Each byte kernel at each level the cpu has, over input it takes in
+  full: printable ASCII for the spans, ASCII and CJK UTF-8 for the
+  decoder, a base64 body, and a search for a string that is not there.
+*/
+#define SIZE                    (1<<20)
+#define BYTES                   (256L<<20)
+
+static char *levels[] = {"c", "sse2", "ssse3", "avx2"};
+static uint8_t buf[SIZE], out[SIZE];
+static uint32_t u[SIZE];
+
+static long
+spans(int (*fn)(uint8_t*, int)) {
+    long n = 0;
+    for (int i = 0; i < 256; i++)
+        n += fn(buf + i, 4096);
+    return n;
+}
+
+static void
+run(char *name, int level, int n, long (*fn)(int)) {
+    long start, done = 0;
+
+    start = get_time();
+    while (done < BYTES)
+        done += fn(n);
+    printf("simd %-14s %-6s %8.0f MB/s\n", name, levels[level],
+        bench_mbs(done, start));
+}
+
+static long
+ascii_span(int n) {
+    (void)n;
+    return spans(simd_ascii_span);
+}
+
+static long
+str_span(int n) {
+    (void)n;
+    return spans(simd_str_span);
+}
+
+static long
+utf8_decode(int n) {
+    int k;
+    return simd_utf8_decode(buf, n, u, SIZE, &k);
+}
+
+static long
+base64_decode(int n) {
+    int k;
+    return simd_base64_decode(buf, n, out, &k);
+}
+
+static long
+find(int n) {
+    simd_find(buf, n, (uint8_t*)"zt:", 3);
+    return n;
+}
+
+static int
+text(int cjk) {
+    uint32_t s = 1, c;
+    int n = 0;
+
+    while (n < SIZE - 3) {
+        if (cjk) {
+            c = 0x4e00 + bench_rand(&s) % 0x5000;
+            buf[n++] = 0xe0 | c >> 12;
+            buf[n++] = 0x80 | (c >> 6 & 0x3f);
+            buf[n++] = 0x80 | (c & 0x3f);
+        } else {
+            buf[n++] = 'a' + bench_rand(&s) % 26;
+        }
+    }
+    return n;
+}
+
+static int
+base64(void) {
+    static char alpha[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t s = 1;
+
+    for (int i = 0; i < SIZE; i++)
+        buf[i] = alpha[bench_rand(&s) % 64];
+    return SIZE;
+}
+
+int
+main(void) {
+    int level, max = simd_level(SIMD_AVX2), n;
+
+    for (level = SIMD_C; level <= max; level++) {
+        simd_level(level);
+        n = text(0);
+        run("ascii_span", level, n, ascii_span);
+        run("str_span", level, n, str_span);
+        run("find", level, n, find);
+        run("utf8 ascii", level, n, utf8_decode);
+        n = text(1);
+        run("utf8 cjk", level, n, utf8_decode);
+        n = base64();
+        run("base64_decode", level, n, base64_decode);
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <termios.h>
+
+#if defined(__linux)
+#include <pty.h>
+#elif defined(__APPLE__)
+#include <util.h>
+#elif defined(__DragonFly__) || defined(__FreeBSD__)
+#include <libutil.h>
+#endif
+
+#include "bench.h"
+#include "../term/uring.h"
+
+/*
+  A child writes the corpus into a raw pty and the terminal reads it the
+  way the zt main loop does: wait on term_fd, then term_read until
+  nothing is pending. Reported per MB are the tty syscalls of
+  term_read, the waits, and the cpu time of this process. io_uring is
+  only there when built with make IO_URING=1.
+*/
+#define CORPUS                  (32L<<20)
+#define WRITE                   (64<<10)
+
+static int
+child(int slave) {
+    struct termios tio;
+    static char buf[WRITE];
+    long n;
+    int i;
+
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    for (i = 0; i < WRITE; i++)
+        buf[i] = i % 81 == 80 ? '\n' : 'a' + i % 26;
+    for (n = 0; n < CORPUS; n += WRITE)
+        if (write(slave, buf, WRITE) != WRITE)
+            return 1;
+    return 0;
+}
+
+static double
+cpu(void) {
+    struct rusage r;
+
+    getrusage(RUSAGE_SELF, &r);
+    return r.ru_utime.tv_sec + r.ru_stime.tv_sec +
+        (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1e6;
+}
+
+static void
+run(int uring) {
+    struct term_t t;
+    struct timespec ts = to_timespec(100 * MILLISECOND);
+    fd_set fds;
+    long waits = 0, start;
+    double c;
+    int master, slave, ret, fd;
+    pid_t pid;
+
+    bench_term(&t, 50, 200);
+    close(t.tty);
+    ASSERT(openpty(&master, &slave, NULL, NULL, NULL) >= 0);
+    ASSERT((pid = fork()) != -1);
+    if (!pid) {
+        close(master);
+        _exit(child(slave));
+    }
+    close(slave);
+    t.tty = master;
+    ASSERT(fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK) >= 0);
+    if (uring && (ret = uring_init(&t))) {
+        printf("tty %-8s %s\n", "io_uring", strerror(ret));
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        term_free(&t);
+        return;
+    }
+
+    start = get_time();
+    c = cpu();
+    for (;;) {
+        if (!term_pending(&t)) {
+            fd = term_fd(&t);
+            FD_ZERO(&fds);
+            FD_SET(fd, &fds);
+            waits++;
+            if (pselect(fd+1, &fds, NULL, NULL, &ts, NULL) < 0)
+                break;
+        }
+        // the pty reads EIO once the child is gone and it is drained
+        if (term_read(&t) && !term_pending(&t))
+            break;
+    }
+    c = cpu() - c;
+    printf("tty %-8s %6.1f syscalls/MB %6.1f waits/MB %6.2f ms cpu/MB "
+        "%7.1f MB/s\n", uring ? "io_uring" : "pselect",
+        t.syscalls / (CORPUS / 1e6), waits / (CORPUS / 1e6),
+        c * 1e3 / (CORPUS / 1e6), bench_mbs(CORPUS, start));
+    waitpid(pid, NULL, 0);
+    term_free(&t);
+}
+
+int
+main(void) {
+    run(0);
+    run(1);
+    return 0;
+}
@@ -152,6 +152,7 @@
 #define DECSC   's' // Save cursor
 #define WINMAN  't' // Window manipulation
 #define DECRC   'u' // Restore cursor
+#define DECRQM  'p' // Request mode, with intermediate $
 #define HPA     '`' // Horizontal position absolute
 
 // DEC private modes
@@ -238,11 +239,6 @@
 #define DECBBSM    116 // Bold and blink style
 #define DECECM     117 // Erase color
 
-static uint8_t csi_end[] __unused = { 0x40, 0x7e };
-static uint8_t nf_end[] __unused = { 0x30, 0x7e };
-static uint8_t dcs_end[] __unused = { C1TOFE(ST), ESC };
-static uint8_t osc_end[] __unused = { BEL, ST, C1TOFE(ST), ESC };
-
 /*
  SGR
       0 Reset
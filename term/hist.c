@@ -0,0 +1,324 @@
+#include "hist.h"
+
+#define HIST_PAGE               (64<<10)
+#define HIST_STYLES             256
+#define HIST_RECENT             16
+
+/*
+  A line is a varint cell count followed by the cells, each its
+  codepoint as a varint. The small values are tags: CELL_STYLE and the
+  page style index of the cells that follow as a varint, CELL_WIDTH and a byte
+  before a cell that is not one column wide, CELL_CLUSTER, a count and
+  the codepoints of a cluster, CELL_LITERAL and a codepoint that would
+  read as a tag. Lines grow from the start of data, their offsets as
+  uint16_t from the end. A page holds HIST_STYLES styles, a line that
+  needs more goes to a new page, which grows its table for it.
+*/
+#define CELL_LITERAL            0
+#define CELL_WIDTH              1
+#define CELL_CLUSTER            2
+#define CELL_STYLE              3
+
+struct hist_page_t {
+    long first;
+    int nline, used, nstyle, size;
+    struct term_style_t *style;
+    uint8_t data[HIST_PAGE];
+};
+
+struct term_hist_t {
+    struct hist_page_t **page, *spare;
+    int npage, size, nbuf;
+    long next;
+    uint8_t *buf;
+};
+
+#define OFF(pg, i) (((uint16_t*)((pg)->data + HIST_PAGE))[-1-(i)])
+
+static inline uint8_t *
+_put(uint8_t *p, uint32_t v) {
+    for (; v >= 0x80; v >>= 7)
+        *p++ = v | 0x80;
+    *p++ = v;
+    return p;
+}
+
+static inline uint8_t *
+_get(uint8_t *p, uint32_t *v) {
+    int s = 0;
+
+    *v = 0;
+    do {
+        *v |= (uint32_t)(*p & 0x7f) << s;
+        s += 7;
+    } while (*p++ & 0x80);
+    return p;
+}
+
+static inline long
+_stored(struct term_hist_t *h) {
+    return h->npage ? h->next - h->page[0]->first : 0;
+}
+
+static inline long
+_mem(struct hist_page_t *pg) {
+    return sizeof(*pg) + pg->size * sizeof(*pg->style);
+}
+
+static void
+_free(struct hist_page_t *pg) {
+    if (pg)
+        free(pg->style);
+    free(pg);
+}
+
+static void
+_drop(struct term_t *t) {
+    struct term_hist_t *h = t->hist.h;
+
+    _free(h->spare);
+    h->spare = h->page[0];
+    memmove(h->page, h->page+1, --h->npage * sizeof(*h->page));
+    t->hist.mem -= _mem(h->spare);
+}
+
+// The oldest page makes room for the new one once the budget is used
+static struct hist_page_t *
+_page(struct term_t *t) {
+    struct term_hist_t *h = t->hist.h;
+    struct hist_page_t *pg;
+
+    while (h->npage && t->hist.mem + sizeof(*pg) +
+        HIST_STYLES * sizeof(*pg->style) > (size_t)t->hist.max_mem)
+        _drop(t);
+    if (h->npage == h->size) {
+        h->size = MAX(h->size*2, 16);
+        ASSERT(h->page = realloc(h->page, h->size * sizeof(*h->page)));
+    }
+    if ((pg = h->spare)) {
+        h->spare = NULL;
+    } else {
+        ASSERT(pg = malloc(sizeof(*pg)));
+        pg->size = HIST_STYLES;
+        ASSERT(pg->style = malloc(pg->size * sizeof(*pg->style)));
+    }
+    pg->first = h->next;
+    pg->nline = pg->used = pg->nstyle = 0;
+    h->page[h->npage++] = pg;
+    t->hist.mem += _mem(pg);
+    return pg;
+}
+
+static int
+_style(struct term_t *t, struct hist_page_t *pg, uint32_t id) {
+    struct term_style_t *s = &t->style.buf[id];
+    int i;
+
+    for (i = pg->nstyle-1; i >= 0; i--)
+        if (!memcmp(&pg->style[i], s, sizeof(*s)))
+            return i;
+    if (pg->nstyle >= HIST_STYLES && pg->nline)
+        return -1;
+    if (pg->nstyle == pg->size) {
+        t->hist.mem -= _mem(pg);
+        pg->size *= 2;
+        ASSERT(pg->style = realloc(pg->style,
+            pg->size * sizeof(*pg->style)));
+        t->hist.mem += _mem(pg);
+    }
+    pg->style[pg->nstyle] = *s;
+    return pg->nstyle++;
+}
+
+// Returns the encoded length in h->buf, or -1 when the page has no
+// room for another style
+static int
+_encode(struct term_t *t, struct hist_page_t *pg, struct term_char_t *l,
+    int cells) {
+    struct term_hist_t *h = t->hist.h;
+    struct term_char_t c;
+    uint8_t *p = h->buf;
+    uint32_t *u, style = STYLE_MAX;
+    int i, k, s, nstyle = pg->nstyle;
+
+    p = _put(p, cells);
+    for (i = 0; i < cells; i++) {
+        c = l[i];
+        if (c.style != style) {
+            if ((s = _style(t, pg, c.style)) < 0) {
+                pg->nstyle = nstyle;
+                return -1;
+            }
+            style = c.style;
+            *p++ = CELL_STYLE;
+            p = _put(p, s);
+        }
+        if (c.c - (CELL_STYLE+1) < 0x80 - (CELL_STYLE+1) && c.width == 1) {
+            *p++ = c.c;
+            continue;
+        }
+        if (c.width != 1) {
+            *p++ = CELL_WIDTH;
+            *p++ = c.width;
+        }
+        if (c.c & CHAR_CLUSTER) {
+            u = term_char(t, &l[i], &k);
+            *p++ = CELL_CLUSTER;
+            p = _put(p, k);
+            while (k--)
+                p = _put(p, *u++ & ~CHAR_CLUSTER);
+        } else {
+            if (c.c <= CELL_STYLE)
+                *p++ = CELL_LITERAL;
+            p = _put(p, c.c);
+        }
+    }
+    return p - h->buf;
+}
+
+void
+hist_push(struct term_t *t, struct term_char_t *l) {
+    struct term_hist_t *h;
+    struct hist_page_t *pg;
+    struct term_char_t b;
+    int n, cells;
+
+    if (t->hist.max <= 0)
+        return;
+    if (!(h = t->hist.h))
+        ASSERT(h = t->hist.h = calloc(1, sizeof(*h)));
+    // a cell takes at most a style, a width and a full cluster
+    if (h->nbuf < 16 + t->col * (12 + 5*CHAR_CLUSTER_MAX)) {
+        h->nbuf = 16 + t->col * (12 + 5*CHAR_CLUSTER_MAX);
+        ASSERT(h->buf = realloc(h->buf, h->nbuf));
+    }
+
+    // trailing blanks in the default style are not kept
+    cells = t->col;
+    b = l[cells-1];
+    if (b.c == ' ' && b.width == 1 && t->style.buf[b.style].mode ==
+        (CHAR_MODE_DEFAULT_FG|CHAR_MODE_DEFAULT_BG))
+        for (; cells > 0 && !memcmp(&l[cells-1], &b, sizeof(b)); cells--);
+
+    pg = h->npage ? h->page[h->npage-1] : NULL;
+    if (!pg || (n = _encode(t, pg, l, cells)) < 0 ||
+        pg->used + n + 2*(pg->nline+1) > HIST_PAGE) {
+        pg = _page(t);
+        // only lines of huge clusters do not fit a page
+        while ((n = _encode(t, pg, l, cells)) + 2 > HIST_PAGE)
+            cells /= 2;
+    }
+    memcpy(pg->data + pg->used, h->buf, n);
+    OFF(pg, pg->nline) = pg->used;
+    pg->used += n;
+    pg->nline++;
+    h->next++;
+
+    while (h->npage > 1 && _stored(h) - h->page[0]->nline >= t->hist.max)
+        _drop(t);
+    t->hist.n = MIN(_stored(h), t->hist.max);
+    if (t->hist.view)
+        t->hist.view = MIN(t->hist.view+1, t->hist.n);
+}
+
+// Appends s to the caller's table unless one of the last HIST_RECENT
+// entries already is s
+static uint32_t
+_add(struct term_styles_t *st, struct term_style_t *s) {
+    int i;
+
+    for (i = st->n-1; i >= 0 && i >= st->n - HIST_RECENT; i--)
+        if (!memcmp(&st->buf[i], s, sizeof(*s)))
+            return i;
+    if (st->n == st->size) {
+        st->size = MAX(st->size*2, HIST_STYLES);
+        ASSERT(st->buf = realloc(st->buf, st->size * sizeof(*st->buf)));
+    }
+    st->buf[st->n] = *s;
+    return st->n++;
+}
+
+// Line i of the last hist.n, 0 is the oldest. Styles are appended to
+// st, a table of the caller such as a snapshot's and never the
+// terminal's, clusters to a.
+int
+hist_get(struct term_t *t, long i, struct term_char_t *l,
+    struct term_cluster_t *a, struct term_styles_t *st) {
+    struct term_hist_t *h = t->hist.h;
+    struct hist_page_t *pg;
+    struct term_style_t blank = {0};
+    struct term_char_t c;
+    uint32_t cells, k, v;
+    uint8_t *p;
+    int lo, hi, mid, x, j;
+
+    if (!h || i < 0 || i >= t->hist.n)
+        return ENOENT;
+    i += h->next - t->hist.n;
+    for (lo = 0, hi = h->npage-1; lo < hi;) {
+        mid = (lo + hi + 1) / 2;
+        if (h->page[mid]->first <= i)
+            lo = mid;
+        else
+            hi = mid-1;
+    }
+    pg = h->page[lo];
+    p = pg->data + OFF(pg, i - pg->first);
+
+    p = _get(p, &cells);
+    cells = MIN((int)cells, t->col);
+    for (x = 0; x < (int)cells; x++) {
+        c.width = 1;
+        p = _get(p, &v);
+        if (v == CELL_STYLE) {
+            p = _get(p, &v);
+            c.style = _add(st, &pg->style[v]);
+            p = _get(p, &v);
+        }
+        if (v == CELL_WIDTH) {
+            c.width = *p++;
+            p = _get(p, &v);
+        }
+        if (v == CELL_CLUSTER) {
+            p = _get(p, &k);
+            if (a->n + (int)k+1 > a->size) {
+                a->size = MAX(a->size*2, a->n + (int)k+1);
+                ASSERT(a->buf = realloc(a->buf,
+                    a->size * sizeof(uint32_t)));
+            }
+            c.c = CHAR_CLUSTER | a->n;
+            a->buf[a->n++] = k;
+            for (j = 0; j < (int)k; j++)
+                p = _get(p, &a->buf[a->n++]);
+        } else {
+            if (v == CELL_LITERAL)
+                p = _get(p, &v);
+            c.c = v;
+        }
+        l[x] = c;
+    }
+
+    blank.mode = CHAR_MODE_DEFAULT_FG | CHAR_MODE_DEFAULT_BG;
+    c.c = ' ';
+    c.width = 1;
+    c.style = _add(st, &blank);
+    for (; x < t->col; x++)
+        l[x] = c;
+    return 0;
+}
+
+void
+hist_free(struct term_t *t) {
+    struct term_hist_t *h = t->hist.h;
+
+    if (!h)
+        return;
+    while (h->npage)
+        _free(h->page[--h->npage]);
+    free(h->page);
+    _free(h->spare);
+    free(h->buf);
+    free(h);
+    t->hist.h = NULL;
+    t->hist.n = t->hist.mem = t->hist.view = 0;
+}
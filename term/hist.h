@@ -0,0 +1,17 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include "term.h"
+
+/*
+  Scrollback of the primary screen. Rows that scroll off the top are
+  encoded as style runs and codepoints into fixed size pages, a line is
+  only decoded again when it is on screen. The oldest pages are dropped
+  once hist.max lines or hist.max_mem bytes are exceeded.
+*/
+void hist_push(struct term_t*, struct term_char_t*);
+int hist_get(struct term_t*, long, struct term_char_t*,
+    struct term_cluster_t*, struct term_styles_t*);
+void hist_free(struct term_t*);
+
+#endif
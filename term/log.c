@@ -0,0 +1,391 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "simd.h"
+
+#define LOG_BUF                 (1<<20)
+#define LOG_LINES               (64<<10)
+#define LOG_SPILL               16
+#define LOG_GAP                 (1ULL<<63)
+#define LOG_BATCH               (100 * MILLISECOND)
+#define LOG_CHUNK               (1L<<20)
+
+/*
+  log_push fills in, the writer swaps it with out and writes that
+  without the lock. lines and pos count what was pushed, disk and
+  disk_pos what the writer has finished. While the writer is behind in
+  grows up to LOG_SPILL times its size, past that lines are dropped and
+  counted in gap. The next line that fits is preceded by a marker line
+  that takes the index entries of all of them, an entry LOG_GAP | k in
+  off repeats the next one k more times.
+*/
+struct log_batch_t {
+    uint8_t *buf;
+    uint64_t *off;
+    int n, noff, size, offcap;
+};
+
+struct term_log_t {
+    int fd, idx, quit, err;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct log_batch_t in, out;
+    uint64_t pos, disk_pos;
+    long lines, disk, gap, dropped;
+};
+
+static inline uint8_t *
+_put_utf8(uint8_t *p, uint32_t u) {
+    if (u < 0x80) {
+        *p++ = u;
+    } else if (u < 0x800) {
+        *p++ = 0xc0 | u >> 6;
+        *p++ = 0x80 | (u & 0x3f);
+    } else if (u < 0x10000) {
+        *p++ = 0xe0 | u >> 12;
+        *p++ = 0x80 | (u >> 6 & 0x3f);
+        *p++ = 0x80 | (u & 0x3f);
+    } else {
+        *p++ = 0xf0 | (u >> 18 & 0x07);
+        *p++ = 0x80 | (u >> 12 & 0x3f);
+        *p++ = 0x80 | (u >> 6 & 0x3f);
+        *p++ = 0x80 | (u & 0x3f);
+    }
+    return p;
+}
+
+static int
+_write(int fd, void *buf, size_t n) {
+    ssize_t ret;
+
+    while (n > 0) {
+        if ((ret = write(fd, buf, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buf = (uint8_t*)buf + ret;
+        n -= ret;
+    }
+    return 0;
+}
+
+// The index of a batch with the gaps spelled out, returns the entries
+static long
+_write_idx(int fd, uint64_t *off, int n, int *err) {
+    uint64_t buf[512];
+    long rep, total = 0;
+    int i, k = 0;
+
+    for (i = 0; i < n && !*err; i++) {
+        rep = 1;
+        if (off[i] & LOG_GAP)
+            rep += off[i++] & ~LOG_GAP;
+        for (; rep > 0 && !*err; rep--) {
+            buf[k++] = off[i];
+            total++;
+            if (k == LEN(buf)) {
+                *err = _write(fd, buf, sizeof(buf));
+                k = 0;
+            }
+        }
+    }
+    if (!*err)
+        *err = _write(fd, buf, k * sizeof(*buf));
+    return total;
+}
+
+static void *
+_writer(void *arg) {
+    struct term_log_t *g = arg;
+    struct timespec ts;
+    long lines = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&g->lock);
+    for (;;) {
+        while (!g->in.noff && !g->quit)
+            pthread_cond_wait(&g->cond, &g->lock);
+        if (!g->in.noff)
+            break;
+        // give the batch time to fill unless log_push asked for it
+        if (!g->quit && g->in.n <= LOG_BUF/2 && g->in.noff <= LOG_LINES/2) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_BATCH;
+            ts.tv_sec += ts.tv_nsec / SECOND;
+            ts.tv_nsec %= SECOND;
+            pthread_cond_timedwait(&g->cond, &g->lock, &ts);
+        }
+        SWAP(g->in, g->out);
+        g->in.n = g->in.noff = 0;
+        pthread_mutex_unlock(&g->lock);
+
+        if (!g->err && !(ret = _write(g->fd, g->out.buf, g->out.n)))
+            lines = _write_idx(g->idx, g->out.off, g->out.noff, &ret);
+        if (!g->err && ret) {
+            LOGERR("failed to write log: %s\n", strerror(ret));
+            g->err = ret;
+        }
+
+        pthread_mutex_lock(&g->lock);
+        if (!g->err) {
+            g->disk += lines;
+            g->disk_pos += g->out.n;
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return NULL;
+}
+
+int
+log_init(struct term_t *t, char *dir) {
+    struct term_log_t *g;
+    char path[PATH_MAX];
+    int fd, idx, n, i;
+
+    // a log is never appended to, a name in use gets a suffix; the index
+    // belongs to the log that was created and is truncated with it
+    for (i = 0;; i++) {
+        n = snprintf(path, sizeof(path), i ? "%s/zt-%ld-%d-%d.log" :
+            "%s/zt-%ld-%d.log", dir, (long)time(NULL), (int)getpid(), i);
+        if (n >= (int)sizeof(path) - 4)
+            return ENAMETOOLONG;
+        if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_APPEND |
+            O_CLOEXEC, 0600)) >= 0)
+            break;
+        if (errno != EEXIST || i == 100)
+            return errno;
+    }
+    strcat(path, ".idx");
+    if ((idx = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND |
+        O_CLOEXEC, 0600)) < 0) {
+        n = errno;
+        close(fd);
+        path[strlen(path) - 4] = 0;
+        unlink(path);
+        return n;
+    }
+
+    ASSERT(g = calloc(1, sizeof(*g)));
+    g->fd = fd;
+    g->idx = idx;
+    g->in.size = g->out.size = LOG_BUF;
+    g->in.offcap = g->out.offcap = LOG_LINES;
+    ASSERT(g->in.buf = malloc(LOG_BUF));
+    ASSERT(g->out.buf = malloc(LOG_BUF));
+    ASSERT(g->in.off = malloc(LOG_LINES * sizeof(*g->in.off)));
+    ASSERT(g->out.off = malloc(LOG_LINES * sizeof(*g->out.off)));
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    ASSERT(!pthread_create(&g->writer, NULL, _writer, g));
+    t->log = g;
+    return 0;
+}
+
+// Makes room for n bytes and k entries in b, up to LOG_SPILL times the
+// batch size
+static int
+_room(struct log_batch_t *b, int n, int k) {
+    while (b->n + n > b->size) {
+        if (b->size >= LOG_SPILL * LOG_BUF)
+            return 0;
+        b->size *= 2;
+        ASSERT(b->buf = realloc(b->buf, b->size));
+    }
+    while (b->noff + k > b->offcap) {
+        if (b->offcap >= LOG_SPILL * LOG_LINES)
+            return 0;
+        b->offcap *= 2;
+        ASSERT(b->off = realloc(b->off, b->offcap * sizeof(*b->off)));
+    }
+    return 1;
+}
+
+// The marker for the lines dropped since the last one that fit
+static void
+_gap(struct term_log_t *g, struct log_batch_t *b) {
+    int n;
+
+    if (g->gap > 1)
+        b->off[b->noff++] = LOG_GAP | (g->gap-1);
+    b->off[b->noff++] = g->pos;
+    n = sprintf((char*)b->buf + b->n, "[zt: %ld lines dropped]\n", g->gap);
+    b->n += n;
+    g->pos += n;
+    g->gap = 0;
+}
+
+// Never waits for the disk. A line that does not fit even the spilled
+// batch is dropped and still counted, see struct term_log_t.
+void
+log_push(struct term_t *t, struct term_char_t *l) {
+    struct term_log_t *g = t->log;
+    uint32_t *u;
+    uint8_t *p;
+    int x, k, n;
+
+    if (!g)
+        return;
+    for (n = t->col; n > 0 && l[n-1].c == ' '; n--);
+
+    pthread_mutex_lock(&g->lock);
+    if (!_room(&g->in, n * 4*CHAR_CLUSTER_MAX + 1 + 64, 3)) {
+        g->gap++;
+        g->dropped++;
+        g->lines++;
+        pthread_cond_signal(&g->cond);
+        pthread_mutex_unlock(&g->lock);
+        return;
+    }
+    if (g->gap)
+        _gap(g, &g->in);
+    p = g->in.buf + g->in.n;
+    for (x = 0; x < n; x++) {
+        if (l[x].c < 0x80) {
+            *p++ = l[x].c;
+            continue;
+        }
+        for (u = term_char(t, &l[x], &k); k > 0; k--)
+            p = _put_utf8(p, *u++);
+        // the cells a wide character covers are not text
+        x += MAX(l[x].width, 1) - 1;
+    }
+    *p++ = '\n';
+    g->in.off[g->in.noff++] = g->pos;
+    g->pos += p - (g->in.buf + g->in.n);
+    g->in.n = p - g->in.buf;
+    g->lines++;
+    if (g->in.n > LOG_BUF/2 || g->in.noff > LOG_LINES/2)
+        pthread_cond_signal(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+}
+
+long
+log_lines(struct term_t *t) {
+    struct term_log_t *g = t->log;
+    long n;
+
+    if (!g)
+        return 0;
+    pthread_mutex_lock(&g->lock);
+    n = g->lines;
+    pthread_mutex_unlock(&g->lock);
+    return n;
+}
+
+long
+log_dropped(struct term_t *t) {
+    struct term_log_t *g = t->log;
+    long n;
+
+    if (!g)
+        return 0;
+    pthread_mutex_lock(&g->lock);
+    n = g->dropped;
+    pthread_mutex_unlock(&g->lock);
+    return n;
+}
+
+long
+log_mem(struct term_t *t) {
+    struct term_log_t *g = t->log;
+    long n;
+
+    if (!g)
+        return 0;
+    pthread_mutex_lock(&g->lock);
+    n = sizeof(*g) + g->in.size + g->out.size +
+        (g->in.offcap + g->out.offcap) * sizeof(*g->in.off);
+    pthread_mutex_unlock(&g->lock);
+    return n;
+}
+
+/*
+  Last line before the given one that contains s, -1 if none. Both
+  files are mapped, the data is scanned backwards in chunks that
+  overlap by m-1 bytes, and the match offset looked up in the index.
+*/
+long
+log_search(struct term_t *t, char *s, int m, long before) {
+    struct term_log_t *g = t->log;
+    uint8_t *data;
+    uint64_t *off;
+    long lines, start, end, i, r, last, lo, hi, mid, found = -1;
+    size_t size;
+
+    if (!g || m <= 0 || m >= LOG_CHUNK)
+        return -1;
+    pthread_mutex_lock(&g->lock);
+    lines = g->disk;
+    size = g->disk_pos;
+    pthread_mutex_unlock(&g->lock);
+    if ((before = MIN(before, lines)) <= 0)
+        return -1;
+
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, g->fd, 0);
+    off = mmap(NULL, lines * sizeof(*off), PROT_READ, MAP_SHARED, g->idx, 0);
+    if (data == MAP_FAILED || off == MAP_FAILED)
+        goto out;
+
+    end = before < lines ? (long)off[before] : (long)size;
+    for (;;) {
+        start = MAX(end - LOG_CHUNK, 0);
+        for (i = start, last = -1; (r = simd_find(data + i, end - i,
+            (uint8_t*)s, m)) >= 0; i += r+1)
+            last = i + r;
+        if (last >= 0) {
+            for (lo = 0, hi = before-1; lo < hi;) {
+                mid = (lo + hi + 1) / 2;
+                if ((long)off[mid] <= last)
+                    lo = mid;
+                else
+                    hi = mid-1;
+            }
+            found = lo;
+            break;
+        }
+        if (!start)
+            break;
+        end = start + m-1;
+    }
+
+out:
+    if (data != MAP_FAILED)
+        munmap(data, size);
+    if (off != MAP_FAILED)
+        munmap(off, lines * sizeof(*off));
+    return found;
+}
+
+void
+log_free(struct term_t *t) {
+    struct term_log_t *g = t->log;
+
+    if (!g)
+        return;
+    pthread_mutex_lock(&g->lock);
+    g->quit = 1;
+    pthread_cond_signal(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+    pthread_join(g->writer, NULL);
+    // lines dropped at the very end still get their marker
+    if (g->gap && !g->err) {
+        g->out.n = g->out.noff = 0;
+        _gap(g, &g->out);
+        if (!_write(g->fd, g->out.buf, g->out.n))
+            _write_idx(g->idx, g->out.off, g->out.noff, &g->err);
+    }
+
+    close(g->fd);
+    close(g->idx);
+    free(g->in.buf);
+    free(g->out.buf);
+    free(g->in.off);
+    free(g->out.off);
+    free(g);
+    t->log = NULL;
+}
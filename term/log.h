@@ -0,0 +1,24 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "term.h"
+
+/*
+  Session log. Rows that leave the top of the primary screen are
+  appended as UTF-8 lines to a file in the directory given to log_init,
+  their offsets as uint64_t to a .idx file next to it. A writer thread
+  does the disk io in batches, log_push only copies into a buffer and
+  never waits for the disk: when the writer is too far behind, lines
+  are dropped and logged as one marker line that keeps the numbering.
+  log_search looks through what is on disk, the index maps a match back
+  to its line.
+*/
+int log_init(struct term_t*, char*);
+void log_push(struct term_t*, struct term_char_t*);
+long log_lines(struct term_t*);
+long log_dropped(struct term_t*);
+long log_mem(struct term_t*);
+long log_search(struct term_t*, char*, int, long);
+void log_free(struct term_t*);
+
+#endif
@@ -0,0 +1,45 @@
+#include "paste.h"
+
+// Newlines are sent as CR like a typed Enter, and ESC is dropped in
+// bracketed mode so the text cannot end the bracket itself. raw text,
+// the brackets, goes as it is.
+void
+paste_put(struct term_paste_t *p, uint8_t *s, int n, int raw) {
+    uint8_t *q;
+    int i;
+
+    if (p->r + p->n + n > p->size) {
+        memmove(p->buf, p->buf + p->r, p->n);
+        p->r = 0;
+        if (p->n + n > p->size) {
+            p->size = MAX(p->size*2, p->n + n);
+            ASSERT(p->buf = realloc(p->buf, p->size));
+        }
+    }
+    q = p->buf + p->r + p->n;
+    for (i = 0; i < n; i++) {
+        if (!raw && s[i] == ESC && p->bracket)
+            continue;
+        *q++ = !raw && s[i] == '\n' ? '\r' : s[i];
+    }
+    p->n = q - (p->buf + p->r);
+}
+
+// Returns the bytes queued for the child
+int
+paste_pump(struct term_t *t, struct term_paste_t *p) {
+    int m = MIN(p->n, MIN(PASTE_CHUNK, t->out.size/2 - t->out.n));
+
+    if (m <= 0 || term_write(t, (char*)p->buf + p->r, m))
+        return 0;
+    p->r += m;
+    p->n -= m;
+    return m;
+}
+
+void
+paste_free(struct term_paste_t *p) {
+    free(p->buf);
+    p->buf = NULL;
+    p->r = p->n = p->size = 0;
+}
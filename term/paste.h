@@ -0,0 +1,24 @@
+#ifndef __PASTE_H__
+#define __PASTE_H__
+
+#include "term.h"
+
+/*
+  Queue of pasted text on its way to the child. paste_put appends what
+  the selection owner sent, paste_pump hands at most PASTE_CHUNK of it
+  to term_write per main loop iteration, so output keeps being read and
+  drawn in between. Half of the output queue is always left for keys
+  and replies.
+*/
+#define PASTE_CHUNK             (64<<10)
+
+struct term_paste_t {
+    uint8_t *buf;
+    int r, n, size, bracket;
+};
+
+void paste_put(struct term_paste_t*, uint8_t*, int, int);
+int paste_pump(struct term_t*, struct term_paste_t*);
+void paste_free(struct term_paste_t*);
+
+#endif
@@ -0,0 +1,156 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "shm.h"
+
+#define SHM_ALIGN               64
+
+struct term_shm_t {
+    int fd, gen, nstyle, ncell, stylecap;
+    char name[NAME_MAX];
+    struct shm_head_t *h;
+    size_t size;
+};
+
+// Room for cells and styles at the given counts, the old mapping is
+// only dropped once the new one is in place
+static int
+_grow(struct term_shm_t *m, int ncell, int nstyle) {
+    size_t cells, styles, size;
+    void *p;
+
+    cells = (sizeof(*m->h) + SHM_ALIGN-1) & ~(SHM_ALIGN-1);
+    styles = cells + ncell * sizeof(struct shm_cell_t);
+    size = styles + nstyle * sizeof(struct shm_style_t);
+    if (ftruncate(m->fd, size) < 0)
+        return errno;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (p == MAP_FAILED)
+        return errno;
+    if (m->h)
+        munmap(m->h, m->size);
+    m->h = p;
+    m->size = size;
+    m->ncell = ncell;
+    m->stylecap = nstyle;
+
+    m->h->magic = SHM_MAGIC;
+    m->h->version = SHM_VERSION;
+    m->h->cells = cells;
+    m->h->styles = styles;
+    // the styles moved
+    m->nstyle = 0;
+    return 0;
+}
+
+int
+shm_init(struct term_t *t, char *name) {
+    struct term_shm_t *m;
+    int ret;
+
+    ASSERT(m = calloc(1, sizeof(*m)));
+    ret = snprintf(m->name, sizeof(m->name), "%s%s",
+        name[0] == '/' ? "" : "/", name);
+    if (ret >= (int)sizeof(m->name)) {
+        free(m);
+        return ENAMETOOLONG;
+    }
+    if ((m->fd = shm_open(m->name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        ret = errno;
+        free(m);
+        return ret;
+    }
+    m->gen = -1;
+    t->shm = m;
+    return 0;
+}
+
+/*
+  Called with the dirty spans of a frame, before they are reset. Only
+  those are written, all of the screen after a new size or a gc of the
+  styles. No system call unless the region has to grow.
+*/
+void
+shm_push(struct term_t *t) {
+    struct term_shm_t *m = t->shm;
+    struct term_char_t *l;
+    struct term_style_t *st;
+    struct shm_cell_t *cells, *d;
+    struct shm_style_t *styles;
+    struct shm_head_t *h;
+    int i, x, y, a, b, n, ret, all;
+
+    if (!m)
+        return;
+    all = !m->h || m->h->row != (uint32_t)t->row ||
+        m->h->col != (uint32_t)t->col || m->gen != t->style.gen;
+    if (t->rowcap * t->colcap > m->ncell || t->style.size > m->stylecap) {
+        if ((ret = _grow(m, MAX(t->rowcap * t->colcap, m->ncell),
+            MAX(t->style.size, m->stylecap)))) {
+            LOGERR("shm: %s, export stopped\n", strerror(ret));
+            shm_free(t);
+            return;
+        }
+        all = 1;
+    }
+    h = m->h;
+    cells = (struct shm_cell_t*)((char*)h + h->cells);
+    styles = (struct shm_style_t*)((char*)h + h->styles);
+
+    __atomic_store_n(&h->seq, h->seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (m->gen != t->style.gen) {
+        m->gen = t->style.gen;
+        m->nstyle = 0;
+    }
+    for (i = m->nstyle; i < t->style.n; i++) {
+        st = &t->style.buf[i];
+        styles[i] = (struct shm_style_t){
+            .fg = {st->fg.type, st->fg.rgb[0], st->fg.rgb[1], st->fg.rgb[2]},
+            .bg = {st->bg.type, st->bg.rgb[0], st->bg.rgb[1], st->bg.rgb[2]},
+            .mode = st->mode,
+        };
+    }
+    m->nstyle = t->style.n;
+
+    for (y = 0; y < t->row; y++) {
+        a = all ? 0 : t->dirty[y].a;
+        b = all ? t->col : t->dirty[y].b;
+        l = term_line_row(t, y);
+        d = cells + y * t->col;
+        if (a >= b)
+            continue;
+        for (x = a; x < b; x++)
+            d[x] = (struct shm_cell_t){
+                .c = l[x].c & CHAR_CLUSTER ? term_char(t, &l[x], &n)[0] :
+                    l[x].c,
+                .style = l[x].style,
+                .width = l[x].width,
+            };
+    }
+
+    h->size = m->size;
+    h->row = t->row;
+    h->col = t->col;
+    h->x = MIN(t->x, t->col-1);
+    h->y = t->y;
+    h->cursor = MODE_ISSET(t, MODE_CURSOR);
+    h->nstyle = m->nstyle;
+    __atomic_store_n(&h->seq, h->seq+1, __ATOMIC_RELEASE);
+}
+
+void
+shm_free(struct term_t *t) {
+    struct term_shm_t *m = t->shm;
+
+    if (!m)
+        return;
+    if (m->h)
+        munmap(m->h, m->size);
+    close(m->fd);
+    shm_unlink(m->name);
+    free(m);
+    t->shm = NULL;
+}
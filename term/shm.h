@@ -0,0 +1,43 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include "term.h"
+
+/*
+  Export of the live screen to a shared memory object for readers on
+  the same machine. The region starts with struct shm_head_t, the cells
+  follow row by row at head.cells and the style table at head.styles,
+  both offsets from the start. Cells are struct shm_cell_t with
+  clusters reduced to their first codepoint, their style indexes the
+  table of struct shm_style_t. Neither depends on how zt lays out its
+  own cells, a change to these is a new head.version.
+
+  head.seq is a seqlock, odd while zt writes. A reader copies what it
+  needs between two reads of it that are equal and even. The region
+  only grows, a reader maps it again when head.size changed.
+*/
+#define SHM_MAGIC               0x6d73747a
+#define SHM_VERSION             2
+
+struct shm_head_t {
+    uint32_t magic, version, seq, size;
+    uint32_t row, col, x, y, cursor;
+    uint32_t cells, styles, nstyle;
+};
+
+struct shm_cell_t {
+    uint32_t c, style;
+    uint8_t width, pad[3];
+};
+
+// Colors are the type, 0, 8 or 24, then the palette index or r, g, b
+struct shm_style_t {
+    uint8_t fg[4], bg[4];
+    uint32_t mode;
+};
+
+int shm_init(struct term_t*, char*);
+void shm_push(struct term_t*);
+void shm_free(struct term_t*);
+
+#endif
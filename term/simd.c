@@ -0,0 +1,472 @@
+#include <string.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+static int
+_ascii_span(uint8_t *p, int n) {
+    int i;
+    for (i = 0; i < n && p[i] >= 0x20 && p[i] <= 0x7e; i++);
+    return i;
+}
+
+static int
+_str_span(uint8_t *p, int n) {
+    int i;
+    for (i = 0; i < n && p[i] >= 0x20; i++);
+    return i;
+}
+
+// Lead byte to sequence length, 0 for continuation and invalid bytes
+static uint8_t _utf8_len[256] = {
+    [0x20 ... 0x7e] = 1,
+    [0xc2 ... 0xdf] = 2,
+    [0xe0 ... 0xef] = 3,
+    [0xf0 ... 0xf4] = 4,
+};
+
+static inline int
+_utf8_step(uint8_t *p, int n, uint32_t *u) {
+    uint32_t c = p[0];
+    int len = _utf8_len[c], i;
+
+    if (len == 1) {
+        *u = c;
+        return 1;
+    }
+    if (len == 0 || len > n)
+        return 0;
+    // CJK and most other wide text, without the loop
+    if (len == 3) {
+        if ((p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80)
+            return 0;
+        c = (c & 0xf) << 12 | (p[1] & 0x3f) << 6 | (p[2] & 0x3f);
+        if (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))
+            return 0;
+        *u = c;
+        return 3;
+    }
+
+    c &= 0x7f >> len;
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+    if ((len == 3 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) ||
+        (len == 4 && (c < 0x10000 || c > 0x10ffff)))
+        return 0;
+    *u = c;
+    return len;
+}
+
+static int
+_utf8_decode(uint8_t *p, int n, uint32_t *u, int cap, int *k) {
+    int i = 0, j = 0, l;
+
+    for (; i < n && j < cap; i += l, j++)
+        if (!(l = _utf8_step(p+i, n-i, u+j)))
+            break;
+    *k = j;
+    return i;
+}
+
+static inline int
+_base64_val(uint8_t c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+static int
+_base64_decode(uint8_t *p, int n, uint8_t *out, int *k) {
+    int i, j = 0, a, b, c, d;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        a = _base64_val(p[i]);
+        b = _base64_val(p[i+1]);
+        if (a < 0 || b < 0)
+            break;
+        out[j++] = a << 2 | b >> 4;
+        c = _base64_val(p[i+2]);
+        d = _base64_val(p[i+3]);
+        if (c >= 0 && d >= 0) {
+            out[j++] = b << 4 | c >> 2;
+            out[j++] = c << 6 | d;
+            continue;
+        }
+        // a padded quad ends the data
+        if (c >= 0 && p[i+3] == '=') {
+            out[j++] = b << 4 | c >> 2;
+            i += 4;
+        } else if (p[i+2] == '=' && p[i+3] == '=') {
+            i += 4;
+        } else {
+            j--;
+        }
+        break;
+    }
+    *k = j;
+    return i;
+}
+
+static long
+_find(uint8_t *p, long n, uint8_t *s, int m) {
+    uint8_t *q, *e = p + n - m + 1;
+
+    for (q = p; q < e && (q = memchr(q, s[0], e - q)); q++)
+        if (!memcmp(q, s, m))
+            return q - p;
+    return -1;
+}
+
+#ifdef SIMD_X86
+
+// Printable ASCII is 0x1f < c < 0x7f as signed bytes,
+// bytes >= 0x80 are negative and fail the first compare.
+
+__attribute__((target("sse2"))) static int
+_ascii_span_sse2(uint8_t *p, int n) {
+    __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f), v;
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((__m128i*)(p+i));
+        v = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        if ((m = _mm_movemask_epi8(v) ^ 0xffff))
+            return i + __builtin_ctz(m);
+    }
+    return i + _ascii_span(p+i, n-i);
+}
+
+__attribute__((target("avx2"))) static int
+_ascii_span_avx2(uint8_t *p, int n) {
+    __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f), v;
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((__m256i*)(p+i));
+        v = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+            _mm256_cmpgt_epi8(hi, v));
+        if ((m = ~(unsigned int)_mm256_movemask_epi8(v)))
+            return i + __builtin_ctz(m);
+    }
+    return i + _ascii_span_sse2(p+i, n-i);
+}
+
+// c >= 0x20 as unsigned bytes is max(c, 0x20) == c
+
+__attribute__((target("sse2"))) static int
+_str_span_sse2(uint8_t *p, int n) {
+    __m128i lo = _mm_set1_epi8(0x20), v;
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((__m128i*)(p+i));
+        v = _mm_cmpeq_epi8(_mm_max_epu8(v, lo), v);
+        if ((m = _mm_movemask_epi8(v) ^ 0xffff))
+            return i + __builtin_ctz(m);
+    }
+    return i + _str_span(p+i, n-i);
+}
+
+__attribute__((target("avx2"))) static int
+_str_span_avx2(uint8_t *p, int n) {
+    __m256i lo = _mm256_set1_epi8(0x20), v;
+    unsigned int m;
+    int i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((__m256i*)(p+i));
+        v = _mm256_cmpeq_epi8(_mm256_max_epu8(v, lo), v);
+        if ((m = ~(unsigned int)_mm256_movemask_epi8(v)))
+            return i + __builtin_ctz(m);
+    }
+    return i + _str_span_sse2(p+i, n-i);
+}
+
+/*
+  Vector kernels for the two common cases, everything else takes one
+  scalar step: a block of printable ASCII is zero extended, and four
+  (eight with AVX2) consecutive 3-byte sequences are gathered into 32-bit
+  lanes with pshufb, checked against the 1110xxxx 10xxxxxx 10xxxxxx
+  pattern, and rejected if overlong or a surrogate. Text that mixes
+  short words with spaces fits neither, after a miss the next
+  UTF8_SCALAR characters are stepped without trying.
+*/
+#define UTF8_SCALAR             8
+#define UTF8_SHUF3 \
+    2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1
+
+__attribute__((target("ssse3"))) static int
+_utf8_decode_ssse3(uint8_t *p, int n, uint32_t *u, int cap, int *k) {
+    __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f),
+            z = _mm_setzero_si128(), shuf = _mm_setr_epi8(UTF8_SHUF3),
+            v, a, c, bad;
+    int i = 0, j = 0, l, skip = 0;
+
+    while (i < n && j < cap) {
+        if (!skip && n-i >= 16 && cap-j >= 16) {
+            v = _mm_loadu_si128((__m128i*)(p+i));
+            a = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+            if (_mm_movemask_epi8(a) == 0xffff) {
+                a = _mm_unpacklo_epi8(v, z);
+                _mm_storeu_si128((__m128i*)(u+j), _mm_unpacklo_epi16(a, z));
+                _mm_storeu_si128((__m128i*)(u+j+4), _mm_unpackhi_epi16(a, z));
+                a = _mm_unpackhi_epi8(v, z);
+                _mm_storeu_si128((__m128i*)(u+j+8), _mm_unpacklo_epi16(a, z));
+                _mm_storeu_si128((__m128i*)(u+j+12), _mm_unpackhi_epi16(a, z));
+                i += 16;
+                j += 16;
+                continue;
+            }
+
+            v = _mm_shuffle_epi8(v, shuf);
+            a = _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf0c0c0)),
+                _mm_set1_epi32(0xe08080));
+            if (_mm_movemask_epi8(a) == 0xffff) {
+                c = _mm_or_si128(
+                    _mm_and_si128(v, _mm_set1_epi32(0x3f)),
+                    _mm_or_si128(
+                    _mm_and_si128(_mm_srli_epi32(v, 2), _mm_set1_epi32(0xfc0)),
+                    _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi32(0xf000))));
+                bad = _mm_or_si128(_mm_cmplt_epi32(c, _mm_set1_epi32(0x800)),
+                    _mm_and_si128(_mm_cmpgt_epi32(c, _mm_set1_epi32(0xd7ff)),
+                    _mm_cmplt_epi32(c, _mm_set1_epi32(0xe000))));
+                if (!_mm_movemask_epi8(bad)) {
+                    _mm_storeu_si128((__m128i*)(u+j), c);
+                    i += 12;
+                    j += 4;
+                    continue;
+                }
+            }
+            skip = UTF8_SCALAR;
+        }
+        if (!(l = _utf8_step(p+i, n-i, u+j)))
+            break;
+        i += l;
+        j++;
+        skip -= skip > 0;
+    }
+    *k = j;
+    return i;
+}
+
+__attribute__((target("avx2"))) static int
+_utf8_decode_avx2(uint8_t *p, int n, uint32_t *u, int cap, int *k) {
+    __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f),
+            shuf = _mm256_setr_epi8(UTF8_SHUF3, UTF8_SHUF3),
+            v, a, c, bad;
+    int i = 0, j = 0, l, skip = 0;
+
+    while (i < n && j < cap) {
+        if (!skip && n-i >= 32 && cap-j >= 32) {
+            v = _mm256_loadu_si256((__m256i*)(p+i));
+            a = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+                _mm256_cmpgt_epi8(hi, v));
+            if (_mm256_movemask_epi8(a) == -1) {
+                for (l = 0; l < 32; l += 8)
+                    _mm256_storeu_si256((__m256i*)(u+j+l), _mm256_cvtepu8_epi32(
+                        _mm_loadl_epi64((__m128i*)(p+i+l))));
+                i += 32;
+                j += 32;
+                continue;
+            }
+
+            v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((__m128i*)(p+i))),
+                _mm_loadu_si128((__m128i*)(p+i+12)), 1);
+            v = _mm256_shuffle_epi8(v, shuf);
+            a = _mm256_cmpeq_epi32(
+                _mm256_and_si256(v, _mm256_set1_epi32(0xf0c0c0)),
+                _mm256_set1_epi32(0xe08080));
+            if (_mm256_movemask_epi8(a) == -1) {
+                c = _mm256_or_si256(
+                    _mm256_and_si256(v, _mm256_set1_epi32(0x3f)),
+                    _mm256_or_si256(
+                    _mm256_and_si256(_mm256_srli_epi32(v, 2),
+                        _mm256_set1_epi32(0xfc0)),
+                    _mm256_and_si256(_mm256_srli_epi32(v, 4),
+                        _mm256_set1_epi32(0xf000))));
+                bad = _mm256_or_si256(
+                    _mm256_cmpgt_epi32(_mm256_set1_epi32(0x800), c),
+                    _mm256_and_si256(
+                    _mm256_cmpgt_epi32(c, _mm256_set1_epi32(0xd7ff)),
+                    _mm256_cmpgt_epi32(_mm256_set1_epi32(0xe000), c)));
+                if (!_mm256_movemask_epi8(bad)) {
+                    _mm256_storeu_si256((__m256i*)(u+j), c);
+                    i += 24;
+                    j += 8;
+                    continue;
+                }
+            }
+            skip = UTF8_SCALAR;
+        }
+        if (!(l = _utf8_step(p+i, n-i, u+j)))
+            break;
+        i += l;
+        j++;
+        skip -= skip > 0;
+    }
+    *k = j;
+    return i;
+}
+
+/*
+  Base64 after Mula and Lemire, the nibble tables flag anything outside
+  the alphabet, '=' included, so such blocks are left to the scalar
+  code. Every store runs 4 (8 for avx2) bytes past the decoded ones,
+  the loop bounds keep that inside out.
+*/
+#define BASE64_LUT_LO 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+                      0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+#define BASE64_LUT_HI 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, \
+                      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define BASE64_ROLL   0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define BASE64_PACK   2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3"))) static int
+_base64_decode_ssse3(uint8_t *p, int n, uint8_t *out, int *k) {
+    __m128i lo = _mm_setr_epi8(BASE64_LUT_LO), hi = _mm_setr_epi8(BASE64_LUT_HI),
+        roll = _mm_setr_epi8(BASE64_ROLL), pack = _mm_setr_epi8(BASE64_PACK),
+        m = _mm_set1_epi8(0x0f), v, h;
+    int i, j = 0, l;
+
+    for (i = 0; i + 32 <= n; i += 16, j += 12) {
+        v = _mm_loadu_si128((__m128i*)(p+i));
+        h = _mm_and_si128(_mm_srli_epi32(v, 4), m);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(v, m)),
+            _mm_shuffle_epi8(hi, h)), _mm_setzero_si128())) != 0xffff)
+            break;
+        v = _mm_add_epi8(v, _mm_shuffle_epi8(roll,
+            _mm_add_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), h)));
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)(out+j), _mm_shuffle_epi8(v, pack));
+    }
+    i += _base64_decode(p+i, n-i, out+j, &l);
+    *k = j + l;
+    return i;
+}
+
+__attribute__((target("avx2"))) static int
+_base64_decode_avx2(uint8_t *p, int n, uint8_t *out, int *k) {
+    __m256i lo = _mm256_setr_epi8(BASE64_LUT_LO, BASE64_LUT_LO),
+        hi = _mm256_setr_epi8(BASE64_LUT_HI, BASE64_LUT_HI),
+        roll = _mm256_setr_epi8(BASE64_ROLL, BASE64_ROLL),
+        pack = _mm256_setr_epi8(BASE64_PACK, BASE64_PACK),
+        m = _mm256_set1_epi8(0x0f), v, h;
+    int i, j = 0, l;
+
+    for (i = 0; i + 64 <= n; i += 32, j += 24) {
+        v = _mm256_loadu_si256((__m256i*)(p+i));
+        h = _mm256_and_si256(_mm256_srli_epi32(v, 4), m);
+        if (~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(v, m)),
+            _mm256_shuffle_epi8(hi, h)), _mm256_setzero_si256())))
+            break;
+        v = _mm256_add_epi8(v, _mm256_shuffle_epi8(roll,
+            _mm256_add_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')), h)));
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack),
+            _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i*)(out+j), v);
+    }
+    i += _base64_decode_ssse3(p+i, n-i, out+j, &l);
+    *k = j + l;
+    return i;
+}
+
+// Candidates have both the first and the last byte of s in place, only
+// those are compared in full
+
+__attribute__((target("sse2"))) static long
+_find_sse2(uint8_t *p, long n, uint8_t *s, int m) {
+    __m128i a = _mm_set1_epi8(s[0]), b = _mm_set1_epi8(s[m-1]), x, y;
+    unsigned int k;
+    long i, r;
+
+    for (i = 0; i + m-1 + 16 <= n; i += 16) {
+        x = _mm_cmpeq_epi8(a, _mm_loadu_si128((__m128i*)(p+i)));
+        y = _mm_cmpeq_epi8(b, _mm_loadu_si128((__m128i*)(p+i+m-1)));
+        for (k = _mm_movemask_epi8(_mm_and_si128(x, y)); k; k &= k-1)
+            if (!memcmp(p + i + __builtin_ctz(k), s, m))
+                return i + __builtin_ctz(k);
+    }
+    return (r = _find(p+i, n-i, s, m)) < 0 ? -1 : i + r;
+}
+
+__attribute__((target("avx2"))) static long
+_find_avx2(uint8_t *p, long n, uint8_t *s, int m) {
+    __m256i a = _mm256_set1_epi8(s[0]), b = _mm256_set1_epi8(s[m-1]), x, y;
+    unsigned int k;
+    long i, r;
+
+    for (i = 0; i + m-1 + 32 <= n; i += 32) {
+        x = _mm256_cmpeq_epi8(a, _mm256_loadu_si256((__m256i*)(p+i)));
+        y = _mm256_cmpeq_epi8(b, _mm256_loadu_si256((__m256i*)(p+i+m-1)));
+        for (k = _mm256_movemask_epi8(_mm256_and_si256(x, y)); k; k &= k-1)
+            if (!memcmp(p + i + __builtin_ctz(k), s, m))
+                return i + __builtin_ctz(k);
+    }
+    return (r = _find_sse2(p+i, n-i, s, m)) < 0 ? -1 : i + r;
+}
+
+#endif
+
+int (*simd_ascii_span)(uint8_t*, int) = _ascii_span;
+int (*simd_str_span)(uint8_t*, int) = _str_span;
+int (*simd_utf8_decode)(uint8_t*, int, uint32_t*, int, int*) = _utf8_decode;
+int (*simd_base64_decode)(uint8_t*, int, uint8_t*, int*) = _base64_decode;
+long (*simd_find)(uint8_t*, long, uint8_t*, int) = _find;
+
+int
+simd_level(int max) {
+    int level = SIMD_C;
+
+    simd_ascii_span = _ascii_span;
+    simd_str_span = _str_span;
+    simd_utf8_decode = _utf8_decode;
+    simd_base64_decode = _base64_decode;
+    simd_find = _find;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (max >= SIMD_SSE2 && __builtin_cpu_supports("sse2")) {
+        level = SIMD_SSE2;
+        simd_ascii_span = _ascii_span_sse2;
+        simd_str_span = _str_span_sse2;
+        simd_find = _find_sse2;
+    }
+    if (max >= SIMD_SSSE3 && __builtin_cpu_supports("ssse3")) {
+        level = SIMD_SSSE3;
+        simd_utf8_decode = _utf8_decode_ssse3;
+        simd_base64_decode = _base64_decode_ssse3;
+    }
+    if (max >= SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+        level = SIMD_AVX2;
+        simd_ascii_span = _ascii_span_avx2;
+        simd_str_span = _str_span_avx2;
+        simd_utf8_decode = _utf8_decode_avx2;
+        simd_base64_decode = _base64_decode_avx2;
+        simd_find = _find_avx2;
+    }
+#endif
+    return level;
+}
+
+void
+simd_init(void) {
+    simd_level(SIMD_AVX2);
+}
@@ -0,0 +1,48 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <stdint.h>
+
+/*
+  Byte scanners with runtime dispatch, simd_init picks the widest
+  implementation the cpu supports and falls back to plain C otherwise.
+*/
+
+// Length of the leading run of printable ASCII (0x20-0x7e) in p
+extern int (*simd_ascii_span)(uint8_t *p, int n);
+
+// Length of the leading run of non C0 bytes in p, the body of a string
+extern int (*simd_str_span)(uint8_t *p, int n);
+
+/*
+  Decode printable UTF-8 from p into at most cap codepoints of u,
+  stopping before control bytes and invalid (overlong, surrogate, out of
+  range) or incomplete sequences. Returns the number of bytes used and
+  the number of codepoints in *k.
+*/
+extern int (*simd_utf8_decode)(uint8_t *p, int n, uint32_t *u, int cap, int *k);
+
+/*
+  Decode base64 from p into out, which has room for n/4*3 bytes.
+  Stops after a padded quad, before an invalid one and before a partial
+  one at the end. Returns the number of bytes used and the decoded
+  length in *k.
+*/
+extern int (*simd_base64_decode)(uint8_t *p, int n, uint8_t *out, int *k);
+
+// Offset of the first occurrence of s (m > 0 bytes) in p, -1 if none
+extern long (*simd_find)(uint8_t *p, long n, uint8_t *s, int m);
+
+/*
+  Kernels up to the given level, as far as the cpu supports them,
+  returns the level in use. simd_init takes the widest.
+*/
+#define SIMD_C                  0
+#define SIMD_SSE2               1
+#define SIMD_SSSE3              2
+#define SIMD_AVX2               3
+
+int simd_level(int);
+void simd_init(void);
+
+#endif
@@ -1,22 +1,32 @@
 #include <pwd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
 
 #if defined(__linux)
 #include <pty.h>
-#define  __USE_XOPEN
 #elif defined(__APPLE__)
 #include <util.h>
 #elif defined(__DragonFly__) || defined(__FreeBSD__)
 #include <libutil.h>
 #endif
 
-#include <wchar.h>
 #include "term.h"
+#include "simd.h"
+#include "uring.h"
+#include "hist.h"
+#include "log.h"
+#include "shm.h"
+#include "width.h"
 
 #define YLIMIT(y) LIMIT(y, 0, t->row-1)
 #define XLIMIT(x) LIMIT(x, 0, t->col-1)
 
+// A row starts one cell into its slot, the cell before holds its flags
+#define ROW_FLAGS(l)            ((l)[-1].c)
+#define ROW_WRAPPED             (1<<0)
+
 static struct {
     uint8_t byte, mask;
     uint32_t min, max;
@@ -63,14 +73,59 @@ term_utf8_decode(void *buf, int len, uint32_t *u, int *ulen) {
     return 0;
 }
 
+int
+term_utf8_feed(struct term_t *t, uint8_t c, uint32_t *u) {
+    uint32_t v;
+    int n = _term_utf8_decode(c, &v);
+
+    if (n == 0 && t->utf8.n) {
+        t->utf8.c = (t->utf8.c << 6) | v;
+        if (--t->utf8.n)
+            return EAGAIN;
+        *u = t->utf8.c;
+        if ((*u < _utf8[t->utf8.len].min || *u > _utf8[t->utf8.len].max) ||
+            (*u >= 0xd800 && *u <= 0xdfff))
+            return EINVAL;
+        return 0;
+    }
+
+    t->utf8.n = 0;
+    if (n <= 0)
+        return EINVAL;
+    if (n == 1) {
+        *u = v;
+        return 0;
+    }
+    t->utf8.c = v;
+    t->utf8.len = n;
+    t->utf8.n = n-1;
+    return EAGAIN;
+}
+
 void
 term_line_dirty(struct term_t *t, int a, int b) {
     ASSERT(a >= 0);
     ASSERT(b >= 0);
-    if (a >= t->col) return;
-    XLIMIT(b);
-    for (; a <= b; a++)
-        t->dirty[a] = 1;
+    if (a >= t->row) return;
+    YLIMIT(b);
+    for (; a <= b; a++) {
+        t->dirty[a].a = 0;
+        t->dirty[a].b = t->col;
+    }
+}
+
+// Columns a to b of row y changed
+static inline void
+term_line_damage(struct term_t *t, int y, int a, int b) {
+    struct term_span_t *d = &t->dirty[y];
+
+    if (d->a >= d->b) {
+        d->a = a;
+        d->b = b+1;
+    } else {
+        d->a = MIN(d->a, a);
+        d->b = MAX(d->b, b+1);
+    }
 }
 
 void
@@ -78,6 +133,54 @@ term_line_dirty_all(struct term_t *t) {
     term_line_dirty(t, 0, t->row-1);
 }
 
+/*
+  The scroll region is a ring, row y of it is kept in
+  line[top + (y-top+scroll) % height]. Scrolling the whole region up or
+  down only moves t->scroll and raises t->scrolled, the region is marked
+  dirty once when the screen is copied. The pointers are only rotated
+  back before the region, the screen or its size changes, term_line_row
+  in term.h reads through the ring.
+*/
+static inline void
+term_line_dirty_scrolled(struct term_t *t) {
+    if (!t->scrolled)
+        return;
+    t->scrolled = 0;
+    term_line_dirty(t, t->top, t->bot);
+}
+
+static void
+term_line_reverse(struct term_char_t **l, int n) {
+    for (int i = 0; i < n/2; i++)
+        SWAP(l[i], l[n-1-i]);
+}
+
+void
+term_line_scroll_flush(struct term_t *t) {
+    struct term_char_t **l = t->line + t->top;
+    int h = t->bot - t->top + 1;
+
+    term_line_dirty_scrolled(t);
+    if (!t->scroll)
+        return;
+    term_line_reverse(l, t->scroll);
+    term_line_reverse(l + t->scroll, h - t->scroll);
+    term_line_reverse(l, h);
+    t->scroll = 0;
+}
+
+// Fill n cells with the k cell pattern p, the filled prefix is doubled
+// so the bulk of the work is done by memcpy
+static inline void
+term_cells_fill(struct term_char_t *l, struct term_char_t *p, int k, int n) {
+    int m;
+
+    if (n <= 0) return;
+    memcpy(l, p, MIN(k, n) * sizeof(*l));
+    for (m = k; m < n; m *= 2)
+        memcpy(l + m, l, MIN(m, n - m) * sizeof(*l));
+}
+
 void
 term_line_move(struct term_t *t, int y, int dst, int src, int n) {
     ASSERT(y >= 0 && y < t->row);
@@ -89,8 +192,9 @@ term_line_move(struct term_t *t, int y, int dst, int src, int n) {
     LIMIT(n, 0, t->col-dst);
     LIMIT(n, 0, t->col-src);
     if (n == 0) return;
-    memmove(&t->line[y][dst], &t->line[y][src],
+    memmove(&term_line_row(t, y)[dst], &term_line_row(t, y)[src],
         n * sizeof(struct term_char_t));
+    term_line_damage(t, y, MIN(dst, src), MAX(dst, src) + n-1);
 }
 
 void
@@ -100,9 +204,11 @@ term_line_erase(struct term_t *t, int y, int a, int b) {
     ASSERT(b >= 0);
     if (a >= t->col) return;
     XLIMIT(b);
-    for (; a <= b && a < t->col; a++)
-        t->line[y][a] = t->c;
-    term_line_dirty(t, y, y);
+    term_cells_fill(term_line_row(t, y) + a, &t->c, 1, b-a+1);
+    // the row no longer runs into the next one
+    if (b == t->col-1)
+        ROW_FLAGS(term_line_row(t, y)) &= ~ROW_WRAPPED;
+    term_line_damage(t, y, a, b);
 }
 
 void
@@ -143,6 +249,7 @@ term_line_moveto(struct term_t *t, int y, int x) {
 
 void
 term_line_top_bottom(struct term_t *t, int top, int bot) {
+    term_line_scroll_flush(t);
     t->top = top;
     t->bot = bot;
     term_line_moveto(t, 0, 0);
@@ -153,33 +260,69 @@ term_line_top_bottom(struct term_t *t, int top, int bot) {
 
 void
 term_line_scroll_up(struct term_t *t, int y, int n) {
+    int h = t->bot - t->top + 1;
+
     if (n <= 0) return;
     n = MIN(n, t->bot-y+1);
-    for (int i = y; i <= t->bot-n; i++)
-        SWAP(t->line[i], t->line[i+n]);
-    term_line_dirty(t, y, t->bot);
+    if (y == t->top) {
+        t->scroll = (t->scroll + n) % h;
+        t->scrolled = 1;
+    } else {
+        for (int i = y; i <= t->bot-n; i++)
+            SWAP(*term_line_slot(t, i), *term_line_slot(t, i+n));
+        term_line_dirty(t, y, t->bot);
+    }
     term_line_clear(t, t->bot-n+1, 0, t->bot, t->col-1);
 }
 
 void
 term_line_scroll_down(struct term_t *t, int y, int n) {
+    int h = t->bot - t->top + 1;
+
     if (n <= 0) return;
     n = MIN(n, t->bot-y+1);
-    for (int i = t->bot; i >= y+n; i--)
-        SWAP(t->line[i], t->line[i-n]);
-    term_line_dirty(t, y, t->bot);
+    if (y == t->top) {
+        t->scroll = (t->scroll - n + h) % h;
+        t->scrolled = 1;
+    } else {
+        for (int i = t->bot; i >= y+n; i--)
+            SWAP(*term_line_slot(t, i), *term_line_slot(t, i-n));
+        term_line_dirty(t, y, t->bot);
+    }
     term_line_clear(t, y, 0, y+n-1, t->col-1);
 }
 
+// Rows scrolled off the top of the primary screen go to the scrollback
+// and the session log, by a newline or by SU alike
+static void
+term_line_scroll_save(struct term_t *t, int n) {
+    if (t->top != 0 || t->line != t->normal.line)
+        return;
+    n = MIN(n, t->bot+1);
+    for (int i = 0; i < n; i++) {
+        hist_push(t, term_line_row(t, i));
+        log_push(t, term_line_row(t, i));
+    }
+}
+
 void
 term_line_new(struct term_t *t) {
     if (t->y == t->bot) {
+        term_line_scroll_save(t, 1);
         term_line_scroll_up(t, t->top, 1);
         return;
     }
-    t->y++;
-    ASSERT(t->y >= 0 && t->y < t->row);
-    //YLIMIT(t->y);
+    // below the region the cursor stops at the last row
+    if (t->y < t->row-1)
+        t->y++;
+}
+
+// Autowrap, the row is marked as continued on the next one
+static inline void
+term_line_wrap(struct term_t *t) {
+    ROW_FLAGS(term_line_row(t, t->y)) |= ROW_WRAPPED;
+    term_line_new(t);
+    t->x = 0;
 }
 
 void
@@ -213,48 +356,360 @@ term_line_tab_reset(struct term_t *t)  {
         t->tabs[i] = 1;
 }
 
+// Display width 0, 1 or 2 from the generated table in width.h
+static inline int
+term_width(uint32_t c) {
+    if (c >= WIDTH_BLOCK * LEN(width_stage1))
+        return 1;
+    return (width_stage2[width_stage1[c / WIDTH_BLOCK]][c % WIDTH_BLOCK / 4]
+        >> (c % 4 * 2)) & 3;
+}
+
 void
-_term_line_write(struct term_t *t, uint32_t c) {
-    int w;
+term_width_span(uint32_t *u, char *w, int n) {
+    for (int i = 0; i < n; i++)
+        w[i] = u[i] < 0x7f ? 1 : term_width(u[i]);
+}
 
-    if ((w = wcwidth(c)) <= 0) {
-        LOG("can't find character width for %u\n", c);
-        w = 1;
+uint32_t *
+term_char(struct term_t *t, struct term_char_t *c, int *n) {
+    uint32_t off = c->c & ~CHAR_CLUSTER;
+
+    if (!(c->c & CHAR_CLUSTER) || (int)off >= t->cluster->n) {
+        *n = 1;
+        return &c->c;
     }
+    *n = t->cluster->buf[off];
+    return t->cluster->buf + off + 1;
+}
 
-    if (t->col - t->x < w) {
-        term_line_new(t);
-        t->x = 0;
+// Move the clusters still referenced from the screen to a fresh buffer
+void
+term_cluster_gc(struct term_t *t, int need) {
+    struct term_cluster_t *a = t->cluster, b;
+    struct term_char_t *c;
+    uint32_t *p;
+    int x, y, n;
+
+    b.n = 0;
+    b.size = MAX(a->size, 256);
+    ASSERT(b.buf = malloc(b.size * sizeof(*b.buf)));
+    for (y = 0; y < t->row; y++)
+        for (x = 0; x < t->col; x++) {
+            c = &t->line[y][x];
+            if (!(c->c & CHAR_CLUSTER))
+                continue;
+            p = term_char(t, c, &n);
+            if (n == 1) {
+                c->c = p[0];
+                continue;
+            }
+            if (b.n + n+1 > b.size) {
+                b.size *= 2;
+                ASSERT(b.buf = realloc(b.buf, b.size * sizeof(*b.buf)));
+            }
+            c->c = CHAR_CLUSTER | b.n;
+            b.buf[b.n++] = n;
+            memcpy(b.buf + b.n, p, n * sizeof(*p));
+            b.n += n;
+        }
+    while (b.n + need > b.size / 2)
+        b.size *= 2;
+    ASSERT(b.buf = realloc(b.buf, b.size * sizeof(*b.buf)));
+
+    free(a->buf);
+    *a = b;
+    if (t->lastc.c & CHAR_CLUSTER)
+        t->lastc.c = 0;
+}
+
+static inline uint32_t
+term_style_hash(struct term_style_t *s) {
+    uint8_t *p = (uint8_t*)s;
+    uint32_t h = 2166136261u;
+
+    for (int i = 0; i < (int)sizeof(*s); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static inline int
+term_style_equal(struct term_style_t *a, struct term_style_t *b) {
+    return term_color_equal(&a->fg, &b->fg) &&
+        term_color_equal(&a->bg, &b->bg) && a->mode == b->mode;
+}
+
+// Open addressing on a table twice the size, slots hold id+1
+static void
+term_style_index(struct term_styles_t *st) {
+    uint32_t i, mask = st->size*2 - 1;
+
+    memset(st->hash, 0, st->size*2 * sizeof(*st->hash));
+    for (int id = 0; id < st->n; id++) {
+        for (i = term_style_hash(&st->buf[id]) & mask; st->hash[i];
+            i = (i+1) & mask);
+        st->hash[i] = id+1;
     }
-    t->line[t->y][t->x] = t->c;
-    t->line[t->y][t->x].c = c;
-    t->line[t->y][t->x].width = w;
-    t->lastc = t->line[t->y][t->x];
+}
+
+static void
+term_style_grow(struct term_styles_t *st, int size) {
+    st->size = size;
+    ASSERT(st->buf = realloc(st->buf, st->size * sizeof(*st->buf)));
+    ASSERT(st->hash = realloc(st->hash, st->size*2 * sizeof(*st->hash)));
+    term_style_index(st);
+}
 
-    term_line_dirty(t, t->y, t->y);
-    for (w--, t->x++; w > 0; t->x++, w--)
-        t->line[t->y][t->x] = t->c;
+// Keep the styles still referenced from either screen or the pen and
+// renumber the cells, like the cluster buffer. A gc bumps gen, copies
+// of the table are then stale.
+void
+term_style_gc(struct term_t *t) {
+    struct term_styles_t *st = &t->style;
+    struct term_char_t **lines[2] = {t->normal.line, t->alt.line}, *c;
+    uint32_t *map;
+    int i, x, y, n = 0;
+
+    ASSERT(map = calloc(st->n, sizeof(*map)));
+    map[t->c.style] = 1;
+    map[t->lastc.style] = 1;
+    for (i = 0; i < 2; i++)
+        for (y = 0; y < t->row; y++)
+            for (x = 0; x < t->col; x++)
+                map[lines[i][y][x].style] = 1;
+    for (i = 0; i < st->n; i++)
+        if (map[i]) {
+            st->buf[n] = st->buf[i];
+            map[i] = n++;
+        }
+    for (i = 0; i < 2; i++)
+        for (y = 0; y < t->row; y++)
+            for (c = lines[i][y], x = 0; x < t->col; x++)
+                c[x].style = map[c[x].style];
+    t->c.style = map[t->c.style];
+    t->lastc.style = map[t->lastc.style];
+    free(map);
+
+    st->n = n;
+    st->gen++;
+    if (st->n > st->size/2 && st->size < STYLE_MAX)
+        term_style_grow(st, st->size*2);
+    else
+        term_style_index(st);
+}
+
+// Colors that are not drawn are cleared so that equal looking
+// styles share an id
+uint32_t
+term_style_intern(struct term_t *t, struct term_style_t *s) {
+    struct term_styles_t *st = &t->style;
+    struct term_style_t k = *s;
+    uint32_t i, h, mask;
+
+    if (MODE_ISSET(&k, CHAR_MODE_DEFAULT_FG))
+        ZERO(k.fg);
+    else if (k.fg.type == 8)
+        k.fg.g = k.fg.b = 0;
+    if (MODE_ISSET(&k, CHAR_MODE_DEFAULT_BG))
+        ZERO(k.bg);
+    else if (k.bg.type == 8)
+        k.bg.g = k.bg.b = 0;
+
+    if (!st->size)
+        term_style_grow(st, 256);
+    h = term_style_hash(&k);
+    for (;;) {
+        mask = st->size*2 - 1;
+        for (i = h & mask; st->hash[i]; i = (i+1) & mask)
+            if (term_style_equal(&st->buf[st->hash[i]-1], &k))
+                return st->hash[i]-1;
+        if (st->n < st->size)
+            break;
+        term_style_gc(t);
+        ASSERT(st->n < st->size);
+    }
+    st->buf[st->n] = k;
+    st->hash[i] = st->n+1;
+    return st->n++;
 }
 
+// Append u to the character last written, if the cursor is still after it
 int
-term_line_write(struct term_t *t, uint8_t *buf, int len, int *wlen) {
-    int ret = 0;
-    uint32_t c;
+term_line_combine(struct term_t *t, uint32_t u, int w) {
+    struct term_char_t *c;
+    struct term_cluster_t *a = t->cluster;
+    uint32_t *p;
+    int n, off;
+
+    if (!t->lastc.c || t->y != t->lasty ||
+        t->x != t->lastx + t->lastc.width)
+        return 0;
 
-    *wlen = 0;
-    if (len <= 0) return 0;
-    c = buf[0];
+    c = &term_line_row(t, t->lasty)[t->lastx];
+    p = term_char(t, c, &n);
+    if (w && p[n-1] != 0x200d)
+        return 0;
+    if (n >= CHAR_CLUSTER_MAX)
+        return 1;
 
-    if (MODE_ISSET(t, MODE_GZD4) && c >= GZD4_MIN && c <= GZD4_MAX) {
-        ret = term_utf8_decode((uint8_t*)gzd4[c-GZD4_MIN], 4, &c, wlen);
-        *wlen = 1;
+    if (n > 1 && p + n == a->buf + a->n && a->n < a->size) {
+        a->buf[a->n++] = u;
+        p[-1]++;
     } else {
-        ret = term_utf8_decode(buf, len, &c, wlen);
+        if (a->n + n+2 > a->size) {
+            term_cluster_gc(t, n+2);
+            p = term_char(t, c, &n);
+        }
+        off = a->n;
+        a->buf[off] = n+1;
+        memcpy(a->buf + off+1, p, n * sizeof(*p));
+        a->buf[off+1+n] = u;
+        a->n += n+2;
+        c->c = CHAR_CLUSTER | off;
     }
+    t->lastc.c = c->c;
+    term_line_damage(t, t->lasty, t->lastx, t->lastx + c->width-1);
+    return 1;
+}
 
-    if (!ret)
-        _term_line_write(t, c);
-    return ret;
+void
+_term_line_write(struct term_t *t, uint32_t c, int w) {
+    struct term_char_t *l;
+
+    if (term_line_combine(t, c, w))
+        return;
+    if (w == 0)
+        w = 1;
+
+    if (t->col - t->x < w)
+        term_line_wrap(t);
+    l = &term_line_row(t, t->y)[t->x];
+    *l = t->c;
+    l->c = c;
+    l->width = w;
+    t->lastc = *l;
+    t->lastx = t->x;
+    t->lasty = t->y;
+
+    term_line_damage(t, t->y, t->x, t->x + w-1);
+    for (w--, t->x++, l++; w > 0; t->x++, w--)
+        *l++ = t->c;
+}
+
+int term_ctrl(struct term_t*, uint8_t);
+void term_ctrl_log(struct term_t*, uint8_t*, int, int);
+
+void
+term_line_write(struct term_t *t, uint8_t c) {
+    uint32_t u;
+    int n;
+
+    if (MODE_ISSET(t, MODE_GZD4) && c >= GZD4_MIN && c <= GZD4_MAX) {
+        t->utf8.n = 0;
+        if (!term_utf8_decode(gzd4[c-GZD4_MIN], 4, &u, &n))
+            _term_line_write(t, u, term_width(u));
+        return;
+    }
+
+    switch (term_utf8_feed(t, c, &u)) {
+    case 0:
+        _term_line_write(t, u, term_width(u));
+        break;
+    case EINVAL:
+        if (ISCTRL1(c)) {
+            t->lastc.c = 0;
+            term_ctrl_log(t, &c, 1, term_ctrl(t, c));
+        } else if (t->debug > 0)
+            LOGERR("drop: %02x\n", c);
+        break;
+    }
+}
+
+// Bulk write of printable ASCII, one template cell and one damage mark per row
+void
+term_line_write_ascii(struct term_t *t, uint8_t *buf, int n) {
+    struct term_char_t c = t->c, *l;
+    int i, m;
+
+    // after a ZWJ the first byte joins the character before it
+    if (t->lastc.c & CHAR_CLUSTER || t->lastc.c == 0x200d) {
+        _term_line_write(t, buf[0], 1);
+        if (!--n)
+            return;
+        buf++;
+    }
+
+    c.width = 1;
+    for (; n > 0; n -= m, buf += m) {
+        if (t->x >= t->col)
+            term_line_wrap(t);
+        m = MIN(n, t->col - t->x);
+        l = &term_line_row(t, t->y)[t->x];
+        for (i = 0; i < m; i++) {
+            l[i] = c;
+            l[i].c = buf[i];
+        }
+        term_line_damage(t, t->y, t->x, t->x + m-1);
+        t->x += m;
+    }
+    t->lastc = term_line_row(t, t->y)[t->x-1];
+    t->lastx = t->x-1;
+    t->lasty = t->y;
+}
+
+// Bulk write of decoded characters, like term_line_write_ascii with the
+// widths of the span. Combining marks, the ZWJ among them, and whatever
+// follows a ZWJ may join the character before and go through
+// _term_line_write.
+static void
+term_line_write_span(struct term_t *t, uint32_t *u, char *w, int n) {
+    struct term_char_t c = t->c, *l;
+    int i = 0, x, k;
+
+    while (i < n) {
+        if (!w[i] || (i ? u[i-1] == 0x200d :
+            t->lastc.c & CHAR_CLUSTER || t->lastc.c == 0x200d)) {
+            _term_line_write(t, u[i], w[i]);
+            i++;
+            continue;
+        }
+        if (t->col - t->x < w[i])
+            term_line_wrap(t);
+        l = term_line_row(t, t->y);
+        x = t->x;
+        do {
+            l[t->x] = c;
+            l[t->x].c = u[i];
+            l[t->x].width = w[i];
+            for (k = 1; k < w[i]; k++)
+                l[t->x+k] = c;
+            t->x += w[i++];
+        } while (i < n && w[i] && t->col - t->x >= w[i]);
+        term_line_damage(t, t->y, x, t->x-1);
+        t->lastx = t->x - w[i-1];
+        t->lasty = t->y;
+        t->lastc = l[t->lastx];
+    }
+}
+
+// Bulk write of UTF-8, decoded and measured a chunk at a time
+int
+term_line_write_utf8(struct term_t *t, uint8_t *buf, int n) {
+    uint32_t u[256];
+    char w[LEN(u)];
+    int m, k, total = 0;
+
+    for (;;) {
+        m = simd_utf8_decode(buf, n, u, LEN(u), &k);
+        term_width_span(u, w, k);
+        term_line_write_span(t, u, w, k);
+        buf += m;
+        n -= m;
+        total += m;
+        if (k < LEN(u))
+            break;
+    }
+    return total;
 }
 
 void
@@ -274,10 +729,37 @@ term_line_dirty_reset(struct term_t *t) {
     memset(t->dirty, 0, t->row * sizeof(*t->dirty));
 }
 
+// REP, a row at a time, the cell and its padding form the fill pattern.
+// After a ZWJ every repetition joins the cluster, that stays one by one.
 void
 term_line_repeat_last(struct term_t *t, int n) {
-    while (t->lastc.c && n--)
-        _term_line_write(t, t->lastc.c);
+    struct term_char_t p[2];
+    uint32_t *u;
+    int w = t->lastc.width, k, m;
+
+    if (!t->lastc.c || n <= 0)
+        return;
+    u = term_char(t, &t->lastc, &k);
+    if (u[k-1] == 0x200d) {
+        while (t->lastc.c && n--)
+            _term_line_write(t, t->lastc.c, t->lastc.width);
+        return;
+    }
+
+    p[0] = p[1] = t->c;
+    p[0].c = t->lastc.c;
+    p[0].width = w;
+    for (; n > 0; n -= m) {
+        if (t->col - t->x < w)
+            term_line_wrap(t);
+        m = MIN(n, (t->col - t->x) / w);
+        term_cells_fill(term_line_row(t, t->y) + t->x, p, w, m*w);
+        term_line_damage(t, t->y, t->x, t->x + m*w-1);
+        t->x += m*w;
+    }
+    t->lastc = p[0];
+    t->lastx = t->x - w;
+    t->lasty = t->y;
 }
 
 void
@@ -291,7 +773,10 @@ term_line_cursor(struct term_t *t, int save) {
 
 void
 term_line_alt(struct term_t *t, int alt, int clear) {
+    term_line_scroll_flush(t);
     t->line = (alt ? t->alt.line : t->normal.line);
+    t->cluster = (alt ? &t->alt.cluster : &t->normal.cluster);
+    t->lastc.c = 0;
     if (clear) term_line_clear_all(t);
     term_line_dirty_all(t);
 }
@@ -300,33 +785,30 @@ void
 term_line_free(struct term_t *t) {
     free(t->normal.buffer);
     free(t->alt.buffer);
+    free(t->normal.cluster.buf);
+    free(t->alt.cluster.buf);
     free(t->dirty);
+    free(t->tabs);
 }
 
-void
-term_line_alloc(struct term_t *t) {
+// Both screens, rowcap rows of colcap cells and their flags
+static void
+term_line_buffers(struct term_t *t) {
     char *p;
     int i, n;
 
-    ASSERT(t->dirty = malloc(t->row * sizeof(*t->dirty)));
-    term_line_dirty_all(t);
-
-    ASSERT(t->tabs = malloc(t->col * sizeof(*t->tabs)));
-    term_line_tab_reset(t);
-
     n = (sizeof(struct term_char_t*) +
-        sizeof(struct term_char_t) * t->col) * t->row;
+        sizeof(struct term_char_t) * (t->colcap+1)) * t->rowcap;
 
 #define X(x) \
     ASSERT(t->x.buffer = malloc(n)); \
     t->x.line = (struct term_char_t **)t->x.buffer; \
-    p = t->x.buffer + sizeof(struct term_char_t*) * t->row; \
-    for (i = 0; i < t->row; i++) { \
-        t->x.line[i] = (struct term_char_t*)p; \
-        p += sizeof(struct term_char_t) * t->col; \
-    }  \
-    t->line = t->x.line; \
-    term_line_clear_all(t);
+    p = t->x.buffer + sizeof(struct term_char_t*) * t->rowcap; \
+    for (i = 0; i < t->rowcap; i++) { \
+        t->x.line[i] = (struct term_char_t*)p + 1; \
+        ROW_FLAGS(t->x.line[i]) = 0; \
+        p += sizeof(struct term_char_t) * (t->colcap+1); \
+    }
 
     X(alt);
     X(normal);
@@ -334,40 +816,218 @@ term_line_alloc(struct term_t *t) {
 }
 
 void
-term_line_resize(struct term_t *t, int r, int c) {
-    int i, j, mr, mc, row = t->row, col = t->col;
-    char *normal_buffer = t->normal.buffer;
-    char *alt_buffer = t->alt.buffer;
-    struct term_char_t **normal_line = t->normal.line;
-    struct term_char_t **alt_line = t->alt.line;
-    int *tabs = t->tabs;
+term_line_alloc(struct term_t *t) {
+    t->rowcap = t->row;
+    t->colcap = t->col;
 
-    t->row = r;
-    t->col = c;
+    ASSERT(t->dirty = malloc(t->rowcap * sizeof(*t->dirty)));
+    term_line_dirty_all(t);
 
-    mr = MIN(t->row, row);
-    mc = MIN(t->col, col);
+    ASSERT(t->tabs = malloc(t->colcap * sizeof(*t->tabs)));
+    term_line_tab_reset(t);
 
-    free(t->dirty);
-    term_line_alloc(t);
+    term_line_buffers(t);
+    term_line_alt(t, 1, 1);
+    term_line_alt(t, 0, 1);
+}
+
+// Blanks from column k on, a row cut to another width ends there
+static inline void
+term_line_pad(struct term_char_t *l, int k, int c, struct term_char_t *b,
+    int cut) {
+    term_cells_fill(l + k, b, 1, c - k);
+    if (cut || !k)
+        ROW_FLAGS(l) = 0;
+}
+
+// Row o of the reflow, the ones before s go to the scrollback through
+// tmp, the ones past the screen are dropped
+static inline struct term_char_t *
+term_reflow_row(struct term_t *t, struct term_char_t *tmp, int o, int s) {
+    if (o < s)
+        return tmp;
+    return o - s < t->row ? t->normal.line[o - s] : NULL;
+}
+
+static inline void
+term_reflow_end(struct term_t *t, struct term_char_t *l, int x,
+    struct term_char_t *b, int wrapped, int push) {
+    if (!l)
+        return;
+    term_line_pad(l, x, t->col, b, 1);
+    if (wrapped)
+        ROW_FLAGS(l) = ROW_WRAPPED;
+    if (push) {
+        hist_push(t, l);
+        log_push(t, l);
+    }
+}
 
-    for (i = 0; i < mr; i++)
-        for (j = 0; j < mc; j++) {
-            t->normal.line[i][j] = normal_line[i][j];
-            t->alt.line[i][j] = alt_line[i][j];
+/*
+  Rows of the primary screen that autowrap split are joined and wrapped
+  again at the new width in one pass over a copy of them, after a dry
+  run that counts the rows. Trailing blanks and the rows below both the
+  cursor and the last text are not kept. When the rows do not fit, the
+  top ones go to the scrollback as far as the cursor stays on screen.
+  The saved cursor moves with the text too, under the alternate screen
+  it is the primary cursor.
+*/
+static void
+term_line_reflow(struct term_t *t, int row, int col, struct term_char_t b) {
+    struct term_char_t *buf, *tmp, *src, *l;
+    uint8_t *wrap;
+    int y, j, k, n, w, x, o, s = 0, L, last, pass, i, nc = 2,
+        *px[2] = {&t->x, &t->x_saved}, *py[2] = {&t->y, &t->y_saved},
+        off[2], cx[2] = {0}, cy[2] = {0};
+
+    if (t->line == t->alt.line) {
+        px[0] = px[1];
+        py[0] = py[1];
+        nc = 1;
+    }
+
+    // spaces show nothing but their background
+#define BLANK(e) ((e).c == ' ' && (t->style.buf[(e).style].mode & \
+    (CHAR_MODE_DEFAULT_BG | CHAR_MODE_COLOR_REVERSE | \
+    CHAR_MODE_UNDERLINE | CHAR_MODE_CROSSED_OUT)) == CHAR_MODE_DEFAULT_BG)
+
+    for (last = row-1; last > MAX(*py[0], *py[nc-1]); last--) {
+        l = t->normal.line[last];
+        for (x = 0; x < col && BLANK(l[x]); x++);
+        if (x < col)
+            break;
+    }
+    ASSERT(buf = malloc(((last+1) * col + t->col+1) * sizeof(*buf) +
+        last+1));
+    tmp = buf + (last+1) * col + 1;
+    wrap = (uint8_t*)(tmp + t->col);
+    for (y = 0; y <= last; y++) {
+        memcpy(buf + y*col, t->normal.line[y], col * sizeof(*buf));
+        wrap[y] = ROW_FLAGS(t->normal.line[y]) & ROW_WRAPPED;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        for (y = 0, o = 0; y <= last; y = j+1, o++) {
+            for (j = y; j < last && wrap[j]; j++);
+            src = buf + y*col;
+            for (n = col; n > 0 && BLANK(src[(j-y)*col + n-1]); n--);
+            L = (j-y)*col + n;
+            for (i = 0; i < 2; i++) {
+                off[i] = i < nc && *py[i] >= y && *py[i] <= j ?
+                    (*py[i]-y)*col + *px[i] : -1;
+                L = MAX(L, off[i]);
+            }
+
+            l = pass ? term_reflow_row(t, tmp, o, s) : NULL;
+            for (k = 0, x = 0; k <= L; k += w) {
+                w = k < L ? MAX(src[k].width, 1) : 1;
+                if (k == L && k != off[0] && k != off[1])
+                    break;
+                // a wide character that did not fit left a blank behind
+                if (k % col == col-1 && k+1 < L && k != off[0] &&
+                    k != off[1] && src[k+1].width == 2 && BLANK(src[k]))
+                    continue;
+                if (x + w > t->col) {
+                    if (pass)
+                        term_reflow_end(t, l, x, &b, 1, o < s);
+                    o++;
+                    l = pass ? term_reflow_row(t, tmp, o, s) : NULL;
+                    x = 0;
+                }
+                for (i = 0; i < nc; i++)
+                    if (off[i] >= k && off[i] < k+w) {
+                        cy[i] = o;
+                        cx[i] = x + off[i]-k;
+                    }
+                if (k == L)
+                    break;
+                if (l)
+                    memcpy(l + x, src + k, w * sizeof(*l));
+                x += w;
+            }
+            if (pass)
+                term_reflow_end(t, l, x, &b, 0, o < s);
+        }
+        // as many rows as fit above the last, the cursor in view
+        s = MIN(MAX(o - t->row, 0), cy[0]);
+    }
+    for (o -= s; o < t->row; o++)
+        term_line_pad(t->normal.line[o], 0, t->col, &b, 1);
+#undef BLANK
+
+    for (i = 0; i < nc; i++) {
+        *px[i] = cx[i];
+        *py[i] = MAX(cy[i] - s, 0);
+    }
+    t->lastc.c = 0;
+    free(buf);
+}
+
+/*
+  The buffers keep the largest size seen, shrinking and growing back
+  within it only clears the cells that come into view again. The
+  primary screen is reflowed, also while the alternate one is up, on
+  that one what a smaller size cut off is lost.
+*/
+void
+term_line_resize(struct term_t *t, int r, int c) {
+    typeof(t->normal) normal = t->normal, alt = t->alt;
+    struct term_style_t blank = {0};
+    struct term_char_t b;
+    int i, k, row = t->row, col = t->col,
+        on_alt = t->line == t->alt.line;
+
+    // the reflow blank is interned while row and col still match the
+    // cells, a gc walks them
+    blank.mode = CHAR_MODE_DEFAULT_FG | CHAR_MODE_DEFAULT_BG;
+    b.c = ' ';
+    b.width = 1;
+    b.style = term_style_intern(t, &blank);
+
+    term_line_scroll_flush(t);
+    if (r > t->rowcap || c > t->colcap) {
+        t->rowcap = MAX(r, t->rowcap);
+        t->colcap = MAX(c, t->colcap);
+        ASSERT(t->dirty = realloc(t->dirty,
+            t->rowcap * sizeof(*t->dirty)));
+        ASSERT(t->tabs = realloc(t->tabs, t->colcap * sizeof(*t->tabs)));
+        term_line_buffers(t);
+        for (i = 0; i < row; i++) {
+            memcpy(t->normal.line[i]-1, normal.line[i]-1,
+                (col+1) * sizeof(struct term_char_t));
+            memcpy(t->alt.line[i]-1, alt.line[i]-1,
+                (col+1) * sizeof(struct term_char_t));
         }
-    free(normal_buffer);
-    free(alt_buffer);
+        free(normal.buffer);
+        free(alt.buffer);
+        t->line = on_alt ? t->alt.line : t->normal.line;
+    }
 
-    for (i = 0; i < mc; i++)
-        t->tabs[i] = tabs[i];
-    free(tabs);
+    t->row = r;
+    t->col = c;
+    // the rows pushed to the scrollback resolve their clusters against
+    // the primary arena, also while the alternate screen is up
+    t->cluster = &t->normal.cluster;
+    term_line_reflow(t, row, col, b);
+    t->cluster = on_alt ? &t->alt.cluster : &t->normal.cluster;
+    for (i = 0; i < r; i++) {
+        k = i < row ? MIN(c, col) : 0;
+        term_line_pad(t->alt.line[i], k, c, &t->c, c != col);
+    }
+    for (i = col; i < c; i++)
+        t->tabs[i] = i % 8 == 0;
+    term_line_dirty_all(t);
 
     XLIMIT(t->x);
     YLIMIT(t->y);
-    t->bot = row - t->bot + t->row;
+    // the margins keep their distance to the bottom
+    t->bot += r - row;
     YLIMIT(t->top);
     YLIMIT(t->bot);
+    if (t->top >= t->bot) {
+        t->top = 0;
+        t->bot = r-1;
+    }
 }
 
 void // for debug
@@ -402,8 +1062,9 @@ term_dump(struct term_t *t) {
         } else
             LOG(" ");
     LOG("\n");
+    term_line_scroll_flush(t);
     for (i = 0; i < t->row; i++) {
-        LOG("%c %3d ", t->dirty[i] ? '*' : ' ', i);
+        LOG("%c %3d ", t->dirty[i].a < t->dirty[i].b ? '*' : ' ', i);
         for (j = 0; j < t->col; j++) {
             c = t->line[i][j];
             if (isprint(c.c))
@@ -419,115 +1080,35 @@ term_dump(struct term_t *t) {
 #undef _space
 }
 
-int
-term_range_end(struct term_t *t, uint8_t *e) {
-    for (int i = t->ctrl.n; i < t->ctrl.size; i++) {
-        if ((t->ctrl.base[i] >= e[0] && t->ctrl.base[i] <= e[1])) {
-            t->ctrl.n = i+1;
-            return 0;
-        }
-    }
-    return EAGAIN;
-}
-
-int
-term_ctrl_end(struct term_t *t, uint8_t *e, int n) {
-    int i, j;
-    for (i = 0; i < n; i++) {
-        for (j = t->ctrl.n; j < t->ctrl.size; j++) {
-            if (t->ctrl.base[j] == e[i]) {
-                t->ctrl.n = j+1;
-                return 0;
-            }
-        }
-    }
-    return EAGAIN;
+static inline int
+term_csi_arg(struct term_t *t, int i, int v0) {
+    if (i >= t->ctrl.npar || t->ctrl.param[i] < 0)
+        return v0;
+    return t->ctrl.param[i];
 }
-#define CTRL_END(c, codes) term_ctrl_end(c, codes, (int)sizeof(codes))
-
-int
-term_ctrl_param(struct term_t *t, int off, int idx, char **p) {
-    int i, a = off, b = off, n;
-
-    for (i = off, n = 0; i < t->ctrl.n-1; i++) {
-        if (t->ctrl.base[i] != ';')
-            continue;
-        if (n == idx) {
-            b = i-1;
-            break;
-        }
-        a = i+1;
-        n++;
-    }
-
-    if (i == t->ctrl.n-1) {
-        if (n == idx)
-            b = t->ctrl.n-2;
-        else
-            return EINVAL;
-    }
-
-    if (a > b) {
-        a = -1;
-        b = -1;
-    }
-
-    if (a < 0) {
-        *p = NULL;
-        return 0;
-    }
-
-    n = b-a+1;
-    if (n > (int)sizeof(t->param)-1)
-        return ENOMEM;
-
-    memcpy(t->param, t->ctrl.base+a, n);
-    t->param[n] = '\0';
-    *p = t->param;
-    return 0;
-
-}
-
-int
-term_ctrl_param_int(struct term_t *t, int off, int idx, int *v, int v0) {
-    int ret;
-    char *p;
-
-    ret = term_ctrl_param(t, off, idx, &p);
-    if (ret)
-        return ret;
-
-    if (p == NULL) {
-        *v = v0;
-        return 0;
-    }
-
-    return stoi(v, p);
-}
-#define CTRL_PARAM_INT(idx, v, v0) \
-    if (term_ctrl_param_int(t, 2, idx, v, v0)) \
-        return EPROTO;
+#define CSI_ARG(i, v0) term_csi_arg(t, i, v0)
+#define CSI_SUB(i) ((i) < t->ctrl.npar && (t->ctrl.sub >> (i) & 1))
 
 #define CHAR_MODE_RESET() do { \
-    ZERO(t->c.fg); \
-    ZERO(t->c.bg); \
-    t->c.mode = CHAR_MODE_DEFAULT_FG | CHAR_MODE_DEFAULT_BG; \
+    ZERO(t->pen); \
+    t->pen.mode = CHAR_MODE_DEFAULT_FG | CHAR_MODE_DEFAULT_BG; \
+    t->c.style = term_style_intern(t, &t->pen); \
     t->c.width = 1;\
     t->c.c = ' ';\
 } while(0)
 
 void
 _term_sgr_c8(struct term_t *t, int fg, int v) {
-    struct term_color_t *c = fg ? & t->c.fg : &t->c.bg;
-    MODE_UNSET(&t->c, fg ? CHAR_MODE_DEFAULT_FG : CHAR_MODE_DEFAULT_BG);
+    struct term_color_t *c = fg ? &t->pen.fg : &t->pen.bg;
+    MODE_UNSET(&t->pen, fg ? CHAR_MODE_DEFAULT_FG : CHAR_MODE_DEFAULT_BG);
     c->type = 8;
     c->c8 = v;
 }
 
 void
 _term_sgr_c24(struct term_t *t, int fg, int r, int g, int b) {
-    struct term_color_t *c = fg ? & t->c.fg : &t->c.bg;
-    MODE_UNSET(&t->c, fg ? CHAR_MODE_DEFAULT_FG : CHAR_MODE_DEFAULT_BG);
+    struct term_color_t *c = fg ? &t->pen.fg : &t->pen.bg;
+    MODE_UNSET(&t->pen, fg ? CHAR_MODE_DEFAULT_FG : CHAR_MODE_DEFAULT_BG);
     LIMIT(r, 0, 255);
     LIMIT(g, 0, 255);
     LIMIT(b, 0, 255);
@@ -537,17 +1118,41 @@ _term_sgr_c24(struct term_t *t, int fg, int r, int g, int b) {
     c->b = b;
 }
 
+// 38/48 arguments starting at i, either 5;v 2;r;g;b or the
+// ITU forms 5:v 2:r:g:b 2:cs:r:g:b. Returns the number used.
 int
-term_sgr(struct term_t *t) {
-    int n, m, v, r, g, b, i;
+term_sgr_color(struct term_t *t, int fg, int i) {
+    int n, v, *p = t->ctrl.param + i;
 
-    if (t->ctrl.npar == 0) {
-        CHAR_MODE_RESET();
-        return 0;
+    if (CSI_SUB(i)) {
+        for (n = 1; CSI_SUB(i+n); n++);
+        if (p[0] == 2 && n >= 5)
+            p++;
+    } else
+        n = MIN(t->ctrl.npar - i, p[0] == 2 ? 4 : 2);
+
+    switch (CSI_ARG(i, 0)) {
+    case 5:
+        if (n < 2 || (v = MAX(p[1], 0)) > 255)
+            return -1;
+        _term_sgr_c8(t, fg, v);
+        break;
+    case 2:
+        if (n < 4)
+            return -1;
+        _term_sgr_c24(t, fg, MAX(p[1], 0), MAX(p[2], 0), MAX(p[3], 0));
+        break;
+    default: return -1;
     }
+    return n;
+}
 
-    for (i = 0; i < t->ctrl.npar;) {
-        CTRL_PARAM_INT(i++, &n, 0);
+static int
+_term_sgr(struct term_t *t) {
+    int n, m, i;
+
+    for (i = 0; i < t->ctrl.npar; i++) {
+        n = CSI_ARG(i, 0);
 
         if (n >= 30 && n <= 37) {
             _term_sgr_c8(t, 1, n-30);
@@ -571,62 +1176,62 @@ term_sgr(struct term_t *t) {
 
         switch (n) {
         case  0: CHAR_MODE_RESET(); break;
-        case  1: MODE_SET(&t->c, CHAR_MODE_BOLD); break;
-        case  2: MODE_SET(&t->c, CHAR_MODE_FAINT); break;
-        case  3: MODE_SET(&t->c, CHAR_MODE_ITALIC); break;
-        case  4: MODE_SET(&t->c, CHAR_MODE_UNDERLINE); break;
-        case  7: MODE_SET(&t->c, CHAR_MODE_COLOR_REVERSE); break;
-        case  9: MODE_SET(&t->c, CHAR_MODE_CROSSED_OUT); break;
-        case 10: MODE_UNSET(&t->c,
+        case  1: MODE_SET(&t->pen, CHAR_MODE_BOLD); break;
+        case  2: MODE_SET(&t->pen, CHAR_MODE_FAINT); break;
+        case  3: MODE_SET(&t->pen, CHAR_MODE_ITALIC); break;
+        case  4:
+            if (CSI_SUB(i+1) && !CSI_ARG(i+1, 1))
+                MODE_UNSET(&t->pen, CHAR_MODE_UNDERLINE);
+            else
+                MODE_SET(&t->pen, CHAR_MODE_UNDERLINE);
+            break;
+        case  7: MODE_SET(&t->pen, CHAR_MODE_COLOR_REVERSE); break;
+        case  9: MODE_SET(&t->pen, CHAR_MODE_CROSSED_OUT); break;
+        case 10: MODE_UNSET(&t->pen,
             CHAR_MODE_BOLD|CHAR_MODE_FAINT|CHAR_MODE_ITALIC); break;
-        case 22: MODE_UNSET(&t->c, CHAR_MODE_BOLD|CHAR_MODE_FAINT); break;
-        case 23: MODE_UNSET(&t->c, CHAR_MODE_ITALIC); break;
-        case 24: MODE_UNSET(&t->c, CHAR_MODE_UNDERLINE); break;
-        case 27: MODE_UNSET(&t->c, CHAR_MODE_COLOR_REVERSE); break;
-        case 29: MODE_UNSET(&t->c, CHAR_MODE_CROSSED_OUT); break;
-        case 39: MODE_SET(&t->c, CHAR_MODE_DEFAULT_FG); break;
-        case 49: MODE_SET(&t->c, CHAR_MODE_DEFAULT_BG); break;
+        case 22: MODE_UNSET(&t->pen, CHAR_MODE_BOLD|CHAR_MODE_FAINT); break;
+        case 23: MODE_UNSET(&t->pen, CHAR_MODE_ITALIC); break;
+        case 24: MODE_UNSET(&t->pen, CHAR_MODE_UNDERLINE); break;
+        case 27: MODE_UNSET(&t->pen, CHAR_MODE_COLOR_REVERSE); break;
+        case 29: MODE_UNSET(&t->pen, CHAR_MODE_CROSSED_OUT); break;
+        case 39: MODE_SET(&t->pen, CHAR_MODE_DEFAULT_FG); break;
+        case 49: MODE_SET(&t->pen, CHAR_MODE_DEFAULT_BG); break;
         case 38:
         case 48:
-            CTRL_PARAM_INT(i++, &m, 0);
-            switch (m) {
-            case 5:
-                CTRL_PARAM_INT(i++, &v, 0);
-                if (v < 0 || v > 255)
-                    return EPROTO;
-                _term_sgr_c8(t, n == 38, v);
-                break;
-            case 2:
-                CTRL_PARAM_INT(i++, &r, 0);
-                CTRL_PARAM_INT(i++, &g, 0);
-                CTRL_PARAM_INT(i++, &b, 0);
-                _term_sgr_c24(t, n == 38, r, g, b);
-                break;
-            default: return EPROTO;
-            }
+            if ((m = term_sgr_color(t, n == 38, i+1)) < 0)
+                return EPROTO;
+            i += m;
             break;
         default: return EPROTO;
         }
+        while (CSI_SUB(i+1))
+            i++;
     }
     return 0;
 }
 
+// The pen is interned once per SGR, cells then take its id
+int
+term_sgr(struct term_t *t) {
+    int ret = _term_sgr(t);
+
+    t->c.style = term_style_intern(t, &t->pen);
+    return ret;
+}
+
 int
 term_mode(struct term_t *t) {
-    int i, n, s, pri;
-    char *p;
+    int i, n, s;
 
-    pri = t->ctrl.base[2] == '?';
+    if (t->ctrl.priv && t->ctrl.priv != '?')
+        return EPROTO;
     s = (t->ctrl.csi == SM ? 1 : 0);
 
 #define _M(v) s ? MODE_SET(t, v) : MODE_UNSET(t , v)
     for (i = 0; i < t->ctrl.npar; i++) {
-        if (term_ctrl_param(t, 2, i, &p) || p == NULL)
+        if ((n = CSI_ARG(i, -1)) < 0)
             continue;
 
-        if (stoi(&n, i == 0 && pri ? p+1 : p))
-            return EPROTO;
-
         switch (n) {
         case DECTCEM: _M(MODE_CURSOR); break;
         case 1000: _M(MODE_MOUSE_PRESS|MODE_MOUSE_RELEASE); break;
@@ -634,6 +1239,8 @@ term_mode(struct term_t *t) {
         case 1003: _M(MODE_MOUSE); break;
         case 1004: _M(MODE_FOCUS); break;
         case 1006: _M(MODE_MOUSE_SGR); break;
+        case 2004: _M(MODE_BRACKETED_PASTE); break;
+        case 2026: _M(MODE_SYNC); t->sync = get_time(); break;
         case DECGRPM:
         case 1047: term_line_alt(t, s, 0); break;
         case 1048: term_line_cursor(t, s); break;
@@ -644,7 +1251,6 @@ term_mode(struct term_t *t) {
         case DECKANAM:
         case 1015: // urxvt Mouse
         case 1005: // UTF8 mouse
-        case 2004: // Bracketed paste
             return EACCES;
         default: return EPROTO;
         }
@@ -653,18 +1259,70 @@ term_mode(struct term_t *t) {
 #undef _M
 }
 
-int
-term_dsr(struct term_t *t) {
-    int n, nw;
-    char wbuf[32], *p;
+// DECRPM values: 1 set, 2 reset, 3 permanently set, 4 permanently reset
+// and 0 for modes that are not known
+static int
+term_mode_state(struct term_t *t, int n) {
+    unsigned long m;
+
+    switch (n) {
+    case DECTCEM: m = MODE_CURSOR; break;
+    case 1000: m = MODE_MOUSE_PRESS|MODE_MOUSE_RELEASE; break;
+    case 1002: m = MODE_MOUSE_MOTION; break;
+    case 1003: m = MODE_MOUSE; break;
+    case 1004: m = MODE_FOCUS; break;
+    case 1006: m = MODE_MOUSE_SGR; break;
+    case 2004: m = MODE_BRACKETED_PASTE; break;
+    case 2026: m = MODE_SYNC; break;
+    case DECGRPM:
+    case 1047:
+    case 1049: return t->line == t->alt.line ? 1 : 2;
+    case DECAWM: return 3;
+    case DECCKM:
+    case DECSCLM:
+    case DECKANAM:
+    case 1015:
+    case 1005: return 4;
+    default: return 0;
+    }
+    return (t->mode & m) == m ? 1 : 2;
+}
 
-    if (t->ctrl.npar == 0 || term_ctrl_param(t, 2, 0, &p) || p == NULL)
+// DECRQM, only private modes are known
+int
+term_mode_report(struct term_t *t) {
+    int nw, n = CSI_ARG(0, 0);
+    char wbuf[32];
+
+    if (t->ctrl.priv == '?')
+        nw = snprintf(wbuf, sizeof(wbuf), "\033[?%d;%d$y",
+            n, term_mode_state(t, n));
+    else if (!t->ctrl.priv)
+        nw = snprintf(wbuf, sizeof(wbuf), "\033[%d;0$y", n);
+    else
         return EPROTO;
+    term_write(t, wbuf, nw);
+    return 0;
+}
+
+// Time left before a synchronized update is drawn unfinished, an
+// application that never ends one is shown after SYNC_TIMEOUT
+long
+term_sync(struct term_t *t) {
+    if (!MODE_ISSET(t, MODE_SYNC))
+        return 0;
+    return MAX(0, SYNC_TIMEOUT - (get_time() - t->sync));
+}
 
-    if (stoi(&n, p[0] == '?' ? p+1 : p))
+int
+term_dsr(struct term_t *t) {
+    int nw;
+    char wbuf[32];
+
+    if (t->ctrl.priv && t->ctrl.priv != '?')
         return EPROTO;
 
-    switch (n) {
+    switch (CSI_ARG(0, -1)) {
     case 5:
         nw = snprintf(wbuf, sizeof(wbuf), "\0330n");
         break;
@@ -678,44 +1336,47 @@ term_dsr(struct term_t *t) {
     return 0;
 }
 
+// c is the final byte, ctrl.buf only keeps the head of a long sequence
 int
-term_csi(struct term_t *t) {
+term_csi(struct term_t *t, uint8_t c) {
     int n = 0, m = 0;
 
+    t->ctrl.csi = c;
+    t->ctrl.npar++;
+
+    if (t->ctrl.invalid)
+        return EPROTO;
+    if (t->ctrl.inter)
+        return t->ctrl.inter == '$' && t->ctrl.csi == DECRQM ?
+            term_mode_report(t) : EPROTO;
+    if (t->ctrl.priv &&
+        t->ctrl.csi != SM && t->ctrl.csi != RM && t->ctrl.csi != DSR)
+        return EPROTO;
+
     switch (t->ctrl.csi) {
     case CUF: case CUB: case CUU: case CUD: case CPL: case CNL:
     case IL: case DL: case DCH: case CHA: case HPA: case VPA:
     case VPR: case HPR: case SU: case SD: case ECH: case CHT:
     case CBT: case ICH: case REP:
-        CTRL_PARAM_INT(0, &n, 1);
+        n = CSI_ARG(0, 1);
         break;
     case ED:
     case EL:
     case TBC:
-        CTRL_PARAM_INT(0, &n, 0);
+    case DA:
+        n = CSI_ARG(0, 0);
         break;
     case DECSTBM:
-        CTRL_PARAM_INT(0, &n, 1);
-        CTRL_PARAM_INT(1, &m, t->row);
+        n = CSI_ARG(0, 1);
+        m = CSI_ARG(1, t->row);
         break;
     case CUP:
     case HVP:
-        if (t->ctrl.npar == 1) {
-            m = 1;
-            CTRL_PARAM_INT(0, &n, 1);
-            break;
-        }
-        CTRL_PARAM_INT(0, &n, 1);
-        CTRL_PARAM_INT(1, &m, 1);
-        break;
-    case DA:
-        if (t->ctrl.npar == 0)
-            n = 0;
-        else
-            CTRL_PARAM_INT(0, &n, 0);
+        n = CSI_ARG(0, 1);
+        m = CSI_ARG(1, 1);
         break;
     case DECRC:
-        if (t->ctrl.npar)
+        if (t->ctrl.npar > 1 || t->ctrl.param[0] >= 0)
             return EPROTO;
         break;
     }
@@ -739,7 +1400,10 @@ term_csi(struct term_t *t) {
     case VPR: term_line_moveto(t, t->y+n, t->y); break;
     case IL: term_line_insert(t, n); break;
     case DL: term_line_delete(t, n); break;
-    case SU: term_line_scroll_up(t, t->top, n); break;
+    case SU:
+        term_line_scroll_save(t, n);
+        term_line_scroll_up(t, t->top, n);
+        break;
     case SD: term_line_scroll_down(t, t->top, n); break;
     case ECH: term_line_erase(t,t->y, t->x, t->x+n-1); break;
     case DECSTBM: term_line_top_bottom(t, n-1, m-1); break;
@@ -770,7 +1434,8 @@ term_csi(struct term_t *t) {
         case 0: term_line_clear(t, t->y, t->x, t->row-1, t->col-1); break;
         case 1: term_line_clear(t, 0, 0, t->y , t->x); break;
         case 2: term_line_clear_all(t); term_line_moveto(t, 0,0); break;
-        case 3: term_line_clear_all(t); term_line_moveto(t, 0,0); break;
+        case 3: term_line_clear_all(t); term_line_moveto(t, 0,0);
+            hist_free(t); break;
         default: return EPROTO;
         }
         break;
@@ -791,26 +1456,13 @@ term_csi(struct term_t *t) {
 
 int
 term_esc(struct term_t *t) {
-    int i;
-
-    if (t->ctrl.size < 2)
-        return EAGAIN;
-
-    t->ctrl.esc = t->ctrl.base[1];
-    t->ctrl.n += 1;
-
-    if (!ISESC(t->ctrl.esc))
-        return EPROTO;
+    t->ctrl.esc = t->ctrl.buf[1];
 
     if (!ISFEESC(t->ctrl.esc)) {
-        if (ISNFESC(t->ctrl.esc)) {
-            if (term_range_end(t, nf_end))
-                return EAGAIN;
-        }
         switch (t->ctrl.esc) {
         case NF_GZD4:
-            if (t->ctrl.size < 3) return EPROTO;
-            switch (t->ctrl.base[2]) {
+            if (t->ctrl.n != 3) return EPROTO;
+            switch (t->ctrl.buf[2]) {
             case 'B': MODE_UNSET(t, MODE_GZD4); break;
             case '0': MODE_SET(t, MODE_GZD4); break;
             default: return EPROTO;
@@ -830,27 +1482,8 @@ term_esc(struct term_t *t) {
     }
 
     switch (FETOC1(t->ctrl.esc)) {
-    case CSI:
-        if (term_range_end(t, csi_end))
-            return EAGAIN;
-
-        t->ctrl.csi = t->ctrl.base[t->ctrl.n-1];
-        for (i = 2; i < t->ctrl.n-1; i++) {
-            if (t->ctrl.base[i] == ';')
-                t->ctrl.npar++;
-        }
-        t->ctrl.npar++;
-        return term_csi(t);
-
-    case OSC:
-        if (CTRL_END(t, osc_end))
-            return EAGAIN;
-        return 0;
-
-    case DCS:
-        if (CTRL_END(t, dcs_end))
-            return EAGAIN;
-        return 0;
+    case ST:
+        break;
 
     case HTS:
         term_line_tab_put(t);
@@ -871,11 +1504,8 @@ term_esc(struct term_t *t) {
 }
 
 int
-term_ctrl(struct term_t *t) {
-    ASSERT(t->ctrl.size > 0);
-    t->ctrl.n = 1;
-    switch (t->ctrl.base[0]) {
-    case ESC: return term_esc(t);
+term_ctrl(struct term_t *t, uint8_t c) {
+    switch (c) {
     case LF: term_line_new(t); break;
     case CR: term_line_moveto(t, t->y, 0); break;
     case HT: term_line_tab(t, 1); break;
@@ -893,123 +1523,477 @@ term_ctrl(struct term_t *t) {
     return 0;
 }
 
-int
-_term_read(struct term_t *t) {
-    uint8_t *p = t->data, *p0;
-    int m, retry_max = 3, ret, n = t->size;
-    char s[BUFSIZ*3+1];
+void
+term_osc(struct term_t *t, int num,
+    void (*fn)(struct term_t*, int, uint8_t*, int)) {
+    int i;
 
-    ASSERT(n >= 0);
-    if (!n) return 0;
+    for (i = 0; i < LEN(t->str.osc) && t->str.osc[i].fn; i++)
+        if (t->str.osc[i].num == num)
+            break;
+    ASSERT(i < LEN(t->str.osc));
+    t->str.osc[i].num = num;
+    t->str.osc[i].fn = fn;
+}
 
-    if (t->debug >= 2)
-        LOG("\n------\n%s\n------\n",
-            ctrl_str(s, sizeof(s), t->data, t->size));
+static void
+term_str_handler(struct term_t *t) {
+    int i;
 
-    for (; n > 0; p += m, n -= m, t->retry = 0) {
-        if (!ISCTRL(p[0])) {
-            if (term_line_write(t, p, n, &m)) {
-                t->retry++;
-                break;
-            }
+    t->str.body = 1;
+    if (t->str.type != OSC)
+        return;
+    for (i = 0; i < LEN(t->str.osc) && t->str.osc[i].fn; i++)
+        if (t->str.osc[i].num == t->str.num) {
+            t->str.h = &t->str.osc[i];
+            t->str.h->fn(t, STR_BEGIN, NULL, 0);
+            break;
+        }
+}
+
+void
+term_str_start(struct term_t *t, uint8_t c) {
+    t->str.type = FETOC1(c);
+    t->str.num = -1;
+    t->str.body = t->str.type != OSC;
+    t->str.n = 0;
+    t->str.h = NULL;
+}
+
+/*
+  String bodies are handed to the handler as they arrive, nothing is
+  buffered. OSC starts with its number up to the first ';'. Once more
+  than str.max bytes were seen the handler is aborted and the rest of
+  the string is dropped.
+*/
+void
+term_str_put(struct term_t *t, uint8_t *p, int n) {
+    for (; !t->str.body && n > 0; p++, n--) {
+        if (*p >= '0' && *p <= '9') {
+            t->str.num = MIN(MAX(t->str.num, 0) * 10 + *p - '0', 0xffff);
             continue;
         }
+        term_str_handler(t);
+        if (*p == ';') {
+            p++;
+            n--;
+        }
+        break;
+    }
 
-        ZERO(t->ctrl);
-        t->ctrl.base = p;
-        t->ctrl.size = n;
-        ret = term_ctrl(t);
-        if (ret == EAGAIN) {
-            t->retry++;
-            break;
+    if ((t->str.n += n) > t->str.max && t->str.h) {
+        t->str.h->fn(t, STR_ABORT, NULL, 0);
+        t->str.h = NULL;
+    }
+    if (t->str.h && n > 0)
+        t->str.h->fn(t, STR_DATA, p, n);
+}
+
+int
+term_str_end(struct term_t *t, int abort) {
+    if (!t->str.body)
+        term_str_handler(t);
+    if (!t->str.h)
+        return EACCES;
+    t->str.h->fn(t, abort ? STR_ABORT : STR_END, NULL, 0);
+    t->str.h = NULL;
+    return 0;
+}
+
+/*
+  DEC/ECMA-48 parser, see https://vt100.net/emu/dec_ansi_parser
+  Every byte is looked up once in vt[state][byte], which yields the
+  action to run and the next state. The state lives in t->ctrl, so
+  sequences may straddle any number of reads.
+*/
+enum {
+    STATE_GROUND,
+    STATE_ESC,
+    STATE_ESC_INTER,
+    STATE_CSI,
+    STATE_OSC,
+    STATE_DCS, // DCS, SOS, PM and APC
+    STATE_NUM,
+};
+
+enum {
+    ACTION_NONE,
+    ACTION_PRINT,
+    ACTION_EXEC,
+    ACTION_START,
+    ACTION_COLLECT,
+    ACTION_PARAM,
+    ACTION_ESC,
+    ACTION_CSI,
+    ACTION_STR_BEGIN,
+    ACTION_STR_PUT,
+    ACTION_STR,
+    ACTION_STR_START,
+    ACTION_STR_ABORT,
+};
+
+static uint8_t vt[STATE_NUM][256];
+
+void
+term_vt_set(int s, int a, int b, int action, int next) {
+    for (; a <= b; a++)
+        vt[s][a] = action << 4 | next;
+}
+
+void
+term_vt_init(void) {
+    int s;
+
+    for (s = 0; s < STATE_NUM; s++) {
+        term_vt_set(s, 0x00, 0xff, ACTION_NONE, s);
+        if (s != STATE_OSC && s != STATE_DCS) {
+            term_vt_set(s, 0x00, 0x17, ACTION_EXEC, s);
+            term_vt_set(s, EM, EM, ACTION_EXEC, s);
+            term_vt_set(s, FS, US, ACTION_EXEC, s);
         }
+        term_vt_set(s, CAN, CAN, ACTION_EXEC, STATE_GROUND);
+        term_vt_set(s, SUB, SUB, ACTION_EXEC, STATE_GROUND);
+        term_vt_set(s, ESC, ESC, ACTION_START, STATE_ESC);
+    }
 
-        m = t->ctrl.n;
-        if (p[0] != ESC)
-            t->lastc.c = 0;
+    term_vt_set(STATE_GROUND, 0x20, 0x7e, ACTION_PRINT, STATE_GROUND);
+    term_vt_set(STATE_GROUND, 0x80, 0xff, ACTION_PRINT, STATE_GROUND);
+
+    term_vt_set(STATE_ESC, 0x20, 0x2f, ACTION_COLLECT, STATE_ESC_INTER);
+    term_vt_set(STATE_ESC, 0x30, 0x7e, ACTION_ESC, STATE_GROUND);
+    term_vt_set(STATE_ESC, C1TOFE(CSI), C1TOFE(CSI),
+        ACTION_COLLECT, STATE_CSI);
+    term_vt_set(STATE_ESC, C1TOFE(OSC), C1TOFE(OSC),
+        ACTION_STR_BEGIN, STATE_OSC);
+    term_vt_set(STATE_ESC, C1TOFE(DCS), C1TOFE(DCS),
+        ACTION_STR_BEGIN, STATE_DCS);
+    term_vt_set(STATE_ESC, C1TOFE(SOS), C1TOFE(SOS),
+        ACTION_STR_BEGIN, STATE_DCS);
+    term_vt_set(STATE_ESC, C1TOFE(PM), C1TOFE(APC),
+        ACTION_STR_BEGIN, STATE_DCS);
+
+    term_vt_set(STATE_ESC_INTER, 0x20, 0x2f, ACTION_COLLECT, STATE_ESC_INTER);
+    term_vt_set(STATE_ESC_INTER, 0x30, 0x7e, ACTION_ESC, STATE_GROUND);
+
+    term_vt_set(STATE_CSI, 0x20, 0x3f, ACTION_PARAM, STATE_CSI);
+    term_vt_set(STATE_CSI, 0x40, 0x7e, ACTION_CSI, STATE_GROUND);
+
+    // text in a sequence cancels it and is printed, so that ESC é c is
+    // not taken for RIS
+    for (s = STATE_ESC; s <= STATE_CSI; s++)
+        term_vt_set(s, 0x80, 0xff, ACTION_PRINT, STATE_GROUND);
+
+    for (s = STATE_OSC; s <= STATE_DCS; s++) {
+        term_vt_set(s, 0x20, 0xff, ACTION_STR_PUT, s);
+        term_vt_set(s, CAN, CAN, ACTION_STR_ABORT, STATE_GROUND);
+        term_vt_set(s, SUB, SUB, ACTION_STR_ABORT, STATE_GROUND);
+        term_vt_set(s, ESC, ESC, ACTION_STR_START, STATE_ESC);
+    }
+    term_vt_set(STATE_OSC, BEL, BEL, ACTION_STR, STATE_GROUND);
+}
 
-        if (t->debug <= 0)
-            continue;
+void
+term_ctrl_log(struct term_t *t, uint8_t *buf, int n, int ret) {
+    char s[sizeof(t->ctrl.buf)*3+1];
+
+    if (t->debug <= 0)
+        return;
+
+    ctrl_str(s, sizeof(s), buf, MIN(n, (int)sizeof(t->ctrl.buf)));
+    switch (ret) {
+    case 0:
+        if (t->debug >= 2)
+            LOG("%s\n", s);
+        break;
+    case EPROTO:
+        if (t->debug == 1)
+            LOG("%s ?????\n", s);
+        break;
+    case EACCES:
+        if (t->debug == 1 && t->no_ignore)
+            LOG("%s ignore\n", s);
+        break;
+    default: DIE();
+    }
+    if (t->debug >= 3)
+        term_dump(t);
+}
+
+static inline void
+term_ctrl_collect(struct term_t *t, uint8_t c) {
+    if (t->ctrl.n < (int)sizeof(t->ctrl.buf))
+        t->ctrl.buf[t->ctrl.n] = c;
+    t->ctrl.n++;
+}
 
-        ctrl_str(s, sizeof(s), t->ctrl.base, t->ctrl.n);
-        switch (ret) {
-        case 0:
-            if (t->debug >= 2)
-                LOG("%s\n", s);
+// Keeps only the head of a string for logging
+static inline void
+term_ctrl_collect_n(struct term_t *t, uint8_t *p, int n) {
+    int m = (int)sizeof(t->ctrl.buf) - t->ctrl.n;
+
+    if (m > 0)
+        memcpy(t->ctrl.buf + t->ctrl.n, p, MIN(m, n));
+    t->ctrl.n = MIN(t->ctrl.n + n, (int)sizeof(t->ctrl.buf)+1);
+}
+
+// CSI parameters are parsed as they arrive, omitted ones are -1 and
+// ':' separated sub-parameters are flagged in ctrl.sub
+static inline void
+term_ctrl_param(struct term_t *t, uint8_t c) {
+    int *p = &t->ctrl.param[t->ctrl.npar];
+
+    if (c >= '0' && c <= '9') {
+        if (t->ctrl.inter)
+            t->ctrl.invalid = 1;
+        *p = MIN(MAX(*p, 0) * 10 + c - '0', 0xffff);
+        return;
+    }
+
+    switch (c) {
+    case ';':
+    case ':':
+        if (t->ctrl.inter || t->ctrl.npar == LEN(t->ctrl.param)-1) {
+            t->ctrl.invalid = 1;
             break;
-        case EPROTO:
-            if (t->debug == 1)
-                LOG("%s ?????\n", s);
+        }
+        t->ctrl.param[++t->ctrl.npar] = -1;
+        if (c == ':')
+            t->ctrl.sub |= 1u << t->ctrl.npar;
+        break;
+    case '<': case '=': case '>': case '?':
+        if (t->ctrl.n != 3)
+            t->ctrl.invalid = 1;
+        t->ctrl.priv = c;
+        break;
+    default:
+        t->ctrl.inter = c;
+    }
+}
+
+void
+_term_read(struct term_t *t, uint8_t *buf, int n) {
+    uint8_t c, e;
+    int m;
+
+    for (int i = 0; i < n; i++) {
+        c = buf[i];
+        e = vt[t->ctrl.state][c];
+        t->ctrl.state = e & 0xf;
+
+        switch (e >> 4) {
+        case ACTION_PRINT:
+            if (MODE_ISSET(t, MODE_GZD4) || t->utf8.n) {
+                term_line_write(t, c);
+                break;
+            }
+            if (c < 0x80) {
+                m = simd_ascii_span(buf+i, n-i);
+                term_line_write_ascii(t, buf+i, m);
+            } else if (!(m = term_line_write_utf8(t, buf+i, n-i))) {
+                term_line_write(t, c);
+                break;
+            }
+            i += m-1;
+            break;
+        case ACTION_EXEC:
+            t->utf8.n = 0;
+            t->lastc.c = 0;
+            term_ctrl_log(t, &c, 1, term_ctrl(t, c));
+            break;
+        case ACTION_STR_ABORT:
+            term_ctrl_log(t, t->ctrl.buf, t->ctrl.n, term_str_end(t, 1));
+            term_ctrl_log(t, &c, 1, term_ctrl(t, c));
+            break;
+        case ACTION_STR_START:
+            term_ctrl_log(t, t->ctrl.buf, t->ctrl.n, term_str_end(t, 0));
+            /* fall through */
+        case ACTION_START:
+            t->utf8.n = 0;
+            t->ctrl.n = 0;
+            t->ctrl.npar = 0;
+            t->ctrl.param[0] = -1;
+            t->ctrl.sub = 0;
+            t->ctrl.priv = 0;
+            t->ctrl.inter = 0;
+            t->ctrl.invalid = 0;
+            term_ctrl_collect(t, c);
+            break;
+        case ACTION_COLLECT:
+            term_ctrl_collect(t, c);
+            break;
+        case ACTION_PARAM:
+            term_ctrl_collect(t, c);
+            term_ctrl_param(t, c);
+            break;
+        case ACTION_ESC:
+            term_ctrl_collect(t, c);
+            term_ctrl_log(t, t->ctrl.buf, t->ctrl.n, term_esc(t));
+            break;
+        case ACTION_CSI:
+            term_ctrl_collect(t, c);
+            term_ctrl_log(t, t->ctrl.buf, t->ctrl.n, term_csi(t, c));
+            break;
+        case ACTION_STR_BEGIN:
+            term_ctrl_collect(t, c);
+            term_str_start(t, c);
+            break;
+        case ACTION_STR_PUT:
+            m = simd_str_span(buf+i, n-i);
+            term_ctrl_collect_n(t, buf+i, m);
+            term_str_put(t, buf+i, m);
+            i += m-1;
             break;
-        case EACCES:
-            if (t->debug == 1 && t->no_ignore)
-                LOG("%s ignore\n", s);
+        case ACTION_STR:
+            term_ctrl_log(t, t->ctrl.buf, t->ctrl.n, term_str_end(t, 0));
             break;
-        default: DIE();
         }
-        if (t->debug >= 3)
-            term_dump(t);
     }
+}
+
+/*
+  The tty is non-blocking and drained into the ring t->in until EAGAIN
+  or until the ring is full, then parsed in place. A call parses at most
+  IN_BUDGET bytes or IN_BUDGET_TIME, whatever comes first, the rest is
+  left for the next call, see term_pending. A chunk is only started when
+  two as slow as the slowest so far still fit the time.
+*/
+static int
+term_read_tty(struct term_t *t) {
+    struct iovec iov[2];
+    int ret, w, k;
+    char s[BUFSIZ*3+1];
 
-    if (t->retry == retry_max) {
-        t->retry = 0;
-        p0 = p;
-        for (; n > 0; p++, n--) {
-            if (ISCTRL(p[0]))
+    while (t->in.n < t->in.size) {
+        w = (t->in.r + t->in.n) % t->in.size;
+        iov[0].iov_base = t->in.buf + w;
+        iov[1].iov_base = t->in.buf;
+        if (w >= t->in.r) {
+            iov[0].iov_len = t->in.size - w;
+            iov[1].iov_len = t->in.r;
+        } else {
+            iov[0].iov_len = t->in.r - w;
+            iov[1].iov_len = 0;
+        }
+        k = iov[1].iov_len ? 2 : 1;
+        t->syscalls++;
+        if ((ret = readv(t->tty, iov, k)) < 0) {
+            if (errno == EAGAIN || errno == EINTR)
                 break;
+            if (errno != EIO)
+                LOGERR("failed to read tty: %s\n", strerror(errno));
+            return errno;
         }
-        LOGERR("drop: %s\n", ctrl_str(s, sizeof(s), p0, p-p0));
-    }
+        if (ret == 0)
+            break;
 
-    return p - t->data;
+        if (t->debug >= 2)
+            LOG("\n------\n%s\n------\n", ctrl_str(s, sizeof(s),
+                iov[0].iov_base, MIN(ret, (int)iov[0].iov_len)));
+        t->in.n += ret;
+    }
+    return 0;
 }
 
 int
 term_read(struct term_t *t) {
-    int ret, m;
-    fd_set fds;
-    struct timespec tv = to_timespec(SECOND);
-
-    ASSERT(t->size >= 0 && t->size <= sizeof(t->data));
-
-    FD_ZERO(&fds);
-    FD_SET(t->tty, &fds);
-    ASSERT(pselect(t->tty+1, &fds, NULL, NULL, &tv, NULL) > 0);
-    if ((ret = read(t->tty, t->data+t->size, sizeof(t->data)-t->size)) < 0) {
-        if (errno != EIO)
-            LOGERR("failed to read tty: %s\n", strerror(errno));
-        return errno;
-    }
-
-    t->size += ret;
-    m = _term_read(t);
-    t->size -= m;
-    if (t->size > 0)
-        memmove(t->data, t->data+m, t->size);
-    return 0;
+    long deadline = get_time() + IN_BUDGET_TIME, now, last = 0;
+    int ret, m, budget = IN_BUDGET;
+
+    if (!t->in.buf)
+        ASSERT(t->in.buf = malloc(t->in.size));
+
+    ret = t->uring ? uring_read(t) : term_read_tty(t);
+    while (t->in.n > 0 && budget > 0 &&
+        (now = get_time()) + 2*last < deadline) {
+        m = MIN(MIN(t->in.n, t->in.size - t->in.r), MIN(budget, IN_CHUNK));
+        _term_read(t, t->in.buf + t->in.r, m);
+        last = MAX(last, get_time() - now);
+        t->in.r = (t->in.r + m) % t->in.size;
+        t->in.n -= m;
+        budget -= m;
+        // the ring is refilled behind the parsed chunk
+        if (t->uring) {
+            uring_submit(t);
+            ret = uring_read(t);
+        }
+        if (t->yield && t->in.n > 0)
+            t->yield(t);
+    }
+    if (t->uring)
+        uring_submit(t);
+    return t->in.n > 0 ? 0 : ret;
+}
+
+// What the main loop waits on for term_read
+int
+term_fd(struct term_t *t) {
+    return t->uring ? uring_fd(t) : t->tty;
 }
 
+/*
+  Input and replies for the child are queued here and written by
+  term_write_flush from the main loop, so whatever was queued in between
+  goes out in one write. A write that does not fit is dropped whole,
+  never cut in the middle of a sequence.
+*/
 int
 term_write(struct term_t *t, char *s, int n) {
-    int ret;
-    fd_set fds;
-    struct timespec tv = to_timespec(SECOND);
+    int w, m;
 
-    for (;;) {
-        if (n <= 0) break;
+    if (n <= 0)
+        return 0;
+    if (!t->out.buf)
+        ASSERT(t->out.buf = malloc(t->out.size));
+    t->out.writes++;
+    if (t->out.n + n > t->out.size) {
+        t->out.dropped += n;
+        if (t->debug > 0)
+            LOGERR("output queue full, %d bytes dropped\n", n);
+        return ENOBUFS;
+    }
+
+    w = (t->out.r + t->out.n) % t->out.size;
+    m = MIN(n, t->out.size - w);
+    memcpy(t->out.buf + w, s, m);
+    memcpy(t->out.buf, s + m, n - m);
+    t->out.n += n;
+    t->out.max = MAX(t->out.max, t->out.n);
+    return 0;
+}
+
+int
+term_write_flush(struct term_t *t) {
+    struct iovec iov[2];
+    int ret;
 
-        FD_ZERO(&fds);
-        FD_SET(t->tty, &fds);
-        ASSERT(pselect(t->tty+1, NULL, &fds, NULL, &tv, NULL) > 0);
+    if (t->uring) {
+        uring_submit(t);
+        return 0;
+    }
 
-        if ((ret = write(t->tty, s, n)) < 0)  {
+    while (t->out.n > 0) {
+        iov[0].iov_base = t->out.buf + t->out.r;
+        iov[0].iov_len = MIN(t->out.n, t->out.size - t->out.r);
+        iov[1].iov_base = t->out.buf;
+        iov[1].iov_len = t->out.n - iov[0].iov_len;
+        t->out.flushes++;
+        t->syscalls++;
+        if ((ret = writev(t->tty, iov, iov[1].iov_len ? 2 : 1)) < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
             if (errno != EIO)
-                LOGERR("failed to read tty: %s\n", strerror(errno));
+                LOGERR("failed to write tty: %s\n", strerror(errno));
+            t->out.n = 0;
             return errno;
         }
-        n -= ret;
-        s += ret;
+        t->out.r = (t->out.r + ret) % t->out.size;
+        t->out.n -= ret;
     }
+
+    if (t->debug >= 2)
+        LOG("out: %d queued, %d max, %ld writes, %ld flushes, "
+            "%ld dropped\n", t->out.n, t->out.max, t->out.writes,
+            t->out.flushes, t->out.dropped);
     return 0;
 }
 
@@ -1021,15 +2005,163 @@ term_resize(struct term_t* t, int r, int c, int w, int h) {
     ws.ws_col = c;
     ws.ws_xpixel = w;
     ws.ws_ypixel = h;
+    // only the pixel size changed, the child is not woken for that
+    if (r == t->row && c == t->col) {
+        term_line_dirty_all(t);
+        return;
+    }
     ASSERT((ret = ioctl(t->tty, TIOCSWINSZ, &ws)) >= 0);
     term_line_resize(t, r, c);
 }
 
+void
+term_view(struct term_t *t, int n) {
+    if (t->line != t->normal.line)
+        n = 0;
+    t->hist.view = n;
+    LIMIT(t->hist.view, 0, t->hist.n);
+}
+
 void
 term_flush(struct term_t* t) {
     term_line_dirty_reset(t);
 }
 
+void
+term_snap(struct term_t *t, struct term_snap_t *s) {
+    struct term_char_t *l;
+    struct term_cluster_t *a;
+    uint32_t *u;
+    int i, x, y, n, view, all = 0;
+
+    // like the screen the copy only grows
+    if (s->row != t->row || s->col != t->col) {
+        if (t->row * t->col > s->cellcap) {
+            s->cellcap = t->row * t->col;
+            ASSERT(s->cells = realloc(s->cells,
+                s->cellcap * sizeof(*s->cells)));
+        }
+        if (t->row > s->rowcap) {
+            ASSERT(s->dirty = realloc(s->dirty,
+                t->row * sizeof(*s->dirty)));
+            ASSERT(s->cluster = realloc(s->cluster,
+                t->row * sizeof(*s->cluster)));
+            for (i = s->rowcap; i < t->row; i++)
+                ZERO(s->cluster[i]);
+            s->rowcap = t->row;
+        }
+        s->row = t->row;
+        s->col = t->col;
+        all = 1;
+    }
+
+    // scrolled back, the top rows come from the history and the
+    // screen moves down by as many
+    view = t->line == t->normal.line ? MIN(t->hist.view, t->hist.n) : 0;
+    if (view || s->view)
+        all = 1;
+    s->view = view;
+
+    // styles are only appended between two gcs, after one every row
+    // is copied again with the new ids. History rows, always all copied,
+    // append theirs behind.
+    if (s->style.gen != t->style.gen) {
+        s->style.gen = t->style.gen;
+        s->nstyle = 0;
+        all = 1;
+    }
+    if (s->style.size < t->style.size) {
+        s->style.size = t->style.size;
+        ASSERT(s->style.buf = realloc(s->style.buf,
+            s->style.size * sizeof(*s->style.buf)));
+    }
+    memcpy(s->style.buf + s->nstyle, t->style.buf + s->nstyle,
+        (t->style.n - s->nstyle) * sizeof(*s->style.buf));
+    s->style.n = s->nstyle = t->style.n;
+    if (all)
+        term_line_dirty_all(t);
+
+    term_line_dirty_scrolled(t);
+    for (y = 0; y < s->row; y++) {
+        s->dirty[y] = t->dirty[y];
+        if (s->dirty[y].a >= s->dirty[y].b)
+            continue;
+        l = s->cells + y * s->col;
+        a = &s->cluster[y];
+        a->n = 0;
+        if (y < view) {
+            hist_get(t, t->hist.n - view + y, l, a, &s->style);
+            continue;
+        }
+        memcpy(l, term_line_row(t, y - view), s->col * sizeof(*l));
+        for (x = 0; x < s->col; x++) {
+            if (!(l[x].c & CHAR_CLUSTER))
+                continue;
+            u = term_char(t, &term_line_row(t, y - view)[x], &n);
+            if (a->n + n+1 > a->size) {
+                a->size = MAX(a->size*2, a->n + n+1);
+                ASSERT(a->buf = realloc(a->buf, a->size * sizeof(uint32_t)));
+            }
+            a->buf[a->n] = n;
+            memcpy(a->buf + a->n+1, u, n * sizeof(uint32_t));
+            l[x].c = CHAR_CLUSTER | a->n;
+            a->n += n+1;
+        }
+    }
+
+    s->x = t->x;
+    s->y = t->y + view;
+    s->cursor = MODE_ISSET(t, MODE_CURSOR) && s->y < s->row;
+    shm_push(t);
+    term_flush(t);
+}
+
+uint32_t *
+term_snap_char(struct term_snap_t *s, int y, struct term_char_t *c, int *n) {
+    uint32_t off = c->c & ~CHAR_CLUSTER;
+
+    if (!(c->c & CHAR_CLUSTER) || (int)off >= s->cluster[y].n) {
+        *n = 1;
+        return &c->c;
+    }
+    *n = s->cluster[y].buf[off];
+    return s->cluster[y].buf + off + 1;
+}
+
+long
+term_mem(struct term_t *t, struct term_snap_t *s, struct term_mem_t *m) {
+    int i;
+
+    m->grid = 2 * (sizeof(struct term_char_t*) +
+        sizeof(struct term_char_t) * (t->colcap+1)) * t->rowcap +
+        t->rowcap * sizeof(*t->dirty) + t->colcap * sizeof(*t->tabs);
+    m->snap = s->cellcap * sizeof(*s->cells) +
+        s->rowcap * (sizeof(*s->dirty) + sizeof(*s->cluster)) +
+        s->style.size * sizeof(*s->style.buf);
+    for (i = 0; i < s->rowcap; i++)
+        m->snap += s->cluster[i].size * sizeof(uint32_t);
+    m->style = t->style.size *
+        (sizeof(*t->style.buf) + 2*sizeof(*t->style.hash));
+    m->cluster = (t->normal.cluster.size + t->alt.cluster.size) *
+        sizeof(uint32_t);
+    m->hist = t->hist.mem;
+    m->log = log_mem(t);
+    m->io = (t->in.buf ? t->in.size : 0) + (t->out.buf ? t->out.size : 0) +
+        uring_mem(t);
+    return m->grid + m->snap + m->style + m->cluster + m->hist + m->log +
+        m->io;
+}
+
+void
+term_snap_free(struct term_snap_t *s) {
+    for (int i = 0; i < s->rowcap; i++)
+        free(s->cluster[i].buf);
+    free(s->cluster);
+    free(s->cells);
+    free(s->dirty);
+    free(s->style.buf);
+}
+
 void
 term_init(struct term_t *t, char *term) {
     char *sh, *args[2];
@@ -1043,7 +2175,13 @@ term_init(struct term_t *t, char *term) {
     t->row = 24;
     t->col = 80;
     t->bot = t->row-1;
-    t->size = 0;
+    t->str.max = STR_MAX;
+    t->hist.max = HIST_MAX;
+    t->hist.max_mem = HIST_MEM;
+    t->in.size = IN_SIZE;
+    t->out.size = OUT_SIZE;
+    term_vt_init();
+    simd_init();
 
     ASSERT((ret = openpty(&t->tty, &slave, NULL, NULL, NULL)) >= 0);
     ASSERT(pw = getpwuid(getuid()));
@@ -1059,6 +2197,8 @@ term_init(struct term_t *t, char *term) {
     if (pid) {
         term_line_alloc(t);
         close(slave);
+        ASSERT(fcntl(t->tty, F_SETFL,
+            fcntl(t->tty, F_GETFL) | O_NONBLOCK) >= 0);
         return;
     }
 
@@ -1085,6 +2225,33 @@ term_init(struct term_t *t, char *term) {
 
 void
 term_free(struct term_t *t) {
+    struct term_char_t *l;
+    int y, n = t->y+1, x;
+
+    // the log ends with what is still on the primary screen. Under the
+    // alt screen its rows are in order, the ring only turns the screen
+    // in use, and kept up to the last one with text. Their clusters are
+    // in the primary arena.
+    if (t->line != t->normal.line) {
+        for (n = t->row; n > 0; n--) {
+            l = t->normal.line[n-1];
+            for (x = 0; x < t->col && l[x].c == ' '; x++);
+            if (x < t->col)
+                break;
+        }
+    }
+    t->cluster = &t->normal.cluster;
+    for (y = 0; t->log && y < n; y++)
+        log_push(t, t->line == t->normal.line ? term_line_row(t, y) :
+            t->normal.line[y]);
+    log_free(t);
+    shm_free(t);
     term_line_free(t);
+    hist_free(t);
+    free(t->style.buf);
+    free(t->style.hash);
+    uring_free(t);
+    free(t->in.buf);
+    free(t->out.buf);
     close(t->tty);
 }
@@ -23,31 +23,118 @@ struct term_color_t {
     };
 };
 
-struct term_char_t {
-    uint32_t c;
-    char width;
+// Colors and CHAR_MODE bits, interned per terminal so that a cell
+// only carries the index
+struct term_style_t {
     struct term_color_t fg, bg;
     unsigned int mode;
 };
 
+struct term_styles_t {
+    struct term_style_t *buf;
+    uint32_t *hash;
+    int n, size, gen;
+};
+
+struct term_char_t {
+    uint32_t c;
+    uint32_t style:24, width:8;
+};
+
+// Extra codepoints of combined characters, a cell refers to one
+// with CHAR_CLUSTER | offset, buf[offset] is the count
+struct term_cluster_t {
+    uint32_t *buf;
+    int n, size;
+};
+
+// Columns [a, b) of a row that changed since the last copy, none when
+// a >= b
+struct term_span_t {
+    int a, b;
+};
+
+// Copy of the screen drawn from outside the parser. Rows are copied
+// when dirty, their clusters go to a buffer per row. The top view rows
+// are history when scrolled back.
+// style holds the terminal's nstyle styles, then those of the history
+// rows on screen, which are decoded anew with every snapshot
+struct term_snap_t {
+    int row, col, rowcap, cellcap, x, y, cursor, view, nstyle;
+    struct term_span_t *dirty;
+    struct term_char_t *cells;
+    struct term_cluster_t *cluster;
+    struct term_styles_t style;
+};
+
+// Bytes held by each part of the terminal, allocated sizes rather than
+// what is in use
+struct term_mem_t {
+    long grid, snap, style, cluster, hist, log, io;
+};
+
+struct term_t;
+
+// String sequence handlers get STR_BEGIN, any number of STR_DATA
+// chunks and either STR_END or STR_ABORT
+struct term_str_t {
+    int num;
+    void (*fn)(struct term_t*, int, uint8_t*, int);
+};
+
 struct term_t {
-    int *dirty, *tabs, row, col, top, bot,
-        x, y, x_saved, y_saved, debug,
-        no_ignore, tty, retry;
+    struct term_span_t *dirty;
+    int *tabs, row, col, rowcap, colcap, top, bot,
+        x, y, x_saved, y_saved, lastx, lasty, scroll, scrolled,
+        debug, no_ignore, tty;
     unsigned long mode;
+    long sync;
+    // readv, writev and io_uring_enter calls on the tty, see bench/tty.c
+    long syscalls;
+    // called by term_read between input chunks, a lock held around
+    // term_read can be handed over there
+    void (*yield)(struct term_t*);
     struct {
         struct term_char_t **line;
         char *buffer;
+        struct term_cluster_t cluster;
     } alt, normal;
     struct term_char_t **line, c, lastc;
+    struct term_cluster_t *cluster;
+    struct term_style_t pen;
+    struct term_styles_t style;
 
-    uint8_t data[BUFSIZ];
-    char param[256];
-    int size;
     struct {
-        int n, npar, size;
-        uint8_t *base, esc, csi;
+        uint8_t *buf;
+        int size, r, n;
+    } in;
+    struct {
+        uint8_t *buf;
+        int size, r, n, max;
+        long writes, flushes, dropped;
+    } out;
+    struct term_uring_t *uring;
+    struct term_log_t *log;
+    struct term_shm_t *shm;
+    struct {
+        struct term_hist_t *h;
+        long n, max, mem, max_mem;
+        int view;
+    } hist;
+    struct {
+        int state, n, npar, param[32], invalid;
+        uint32_t sub;
+        uint8_t buf[256], esc, csi, priv, inter;
     } ctrl;
+    struct {
+        uint32_t c;
+        int n, len;
+    } utf8;
+    struct {
+        int type, num, body;
+        long n, max;
+        struct term_str_t *h, osc[16];
+    } str;
 };
 
 #define SECOND      1000000000L
@@ -106,6 +193,8 @@ struct term_t {
 #define MODE_MOUSE_MOTION       (1<<4)
 #define MODE_MOUSE_SGR          (1<<5)
 #define MODE_GZD4               (1<<6)
+#define MODE_BRACKETED_PASTE    (1<<7)
+#define MODE_SYNC               (1<<8)
 #define MODE_MOUSE              (MODE_MOUSE_PRESS | \
                                  MODE_MOUSE_RELEASE | \
                                  MODE_MOUSE_MOTION | \
@@ -120,12 +209,68 @@ struct term_t {
 #define CHAR_MODE_COLOR_REVERSE (1<<6)
 #define CHAR_MODE_CROSSED_OUT   (1<<7)
 
+#define STR_BEGIN               0
+#define STR_DATA                1
+#define STR_END                 2
+#define STR_ABORT               3
+#define STR_MAX                 (16L<<20)
+
+#define IN_SIZE                 (1<<20)
+#define IN_BUDGET               (256<<10)
+#define IN_BUDGET_TIME          (5 * MILLISECOND)
+#define IN_CHUNK                (16<<10)
+#define OUT_SIZE                (256<<10)
+#define SYNC_TIMEOUT            (150 * MILLISECOND)
+
+#define CHAR_CLUSTER            (1u<<31)
+#define CHAR_CLUSTER_MAX        16
+#define STYLE_MAX               (1<<24)
+#define HIST_MAX                10000
+#define HIST_MEM                (32L<<20)
+
 void term_init(struct term_t*, char*);
 void term_free(struct term_t*);
 int term_read(struct term_t*);
+int term_fd(struct term_t*);
 int term_write(struct term_t*, char*, int);
+int term_write_flush(struct term_t*);
 void term_flush(struct term_t*);
 void term_resize(struct term_t*, int, int, int, int);
+long term_sync(struct term_t*);
+void term_view(struct term_t*, int);
+uint32_t term_style_intern(struct term_t*, struct term_style_t*);
+uint32_t *term_char(struct term_t*, struct term_char_t*, int*);
+void term_snap(struct term_t*, struct term_snap_t*);
+void term_snap_free(struct term_snap_t*);
+long term_mem(struct term_t*, struct term_snap_t*, struct term_mem_t*);
+uint32_t *term_snap_char(struct term_snap_t*, int,
+    struct term_char_t*, int*);
+void term_osc(struct term_t*, int,
+    void (*)(struct term_t*, int, uint8_t*, int));
+
+// Input is left in the ring after term_read ran out of budget
+static inline int
+term_pending(struct term_t *t) {
+    return t->in.n > 0;
+}
+
+static inline int
+term_write_pending(struct term_t *t) {
+    return t->out.n > 0;
+}
+
+// Row y of the screen, see the scroll ring in term.c
+static inline struct term_char_t **
+term_line_slot(struct term_t *t, int y) {
+    if (t->scroll && y >= t->top && y <= t->bot)
+        y = t->top + (y - t->top + t->scroll) % (t->bot - t->top + 1);
+    return &t->line[y];
+}
+
+static inline struct term_char_t *
+term_line_row(struct term_t *t, int y) {
+    return *term_line_slot(t, y);
+}
 
 static inline int
 term_color_equal(struct term_color_t *a, struct term_color_t *b) {
@@ -138,9 +283,7 @@ term_color_equal(struct term_color_t *a, struct term_color_t *b) {
 
 static inline int
 term_attr_equal(struct term_char_t *a, struct term_char_t *b) {
-    return term_color_equal(&a->fg, &b->fg) &&
-        term_color_equal(&a->bg, &b->bg) &&
-        a->mode == b->mode && a->width == b->width;
+    return a->style == b->style && a->width == b->width;
 }
 
 static inline int
@@ -0,0 +1,332 @@
+#include "uring.h"
+
+#if defined(__linux) && defined(IO_URING)
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 8
+#define URING_READ    1
+#define URING_WRITE   2
+#define URING_POLL    3
+#define URING_BUFS    64
+#define URING_BUF     4096
+#define URING_GROUP   0
+// IORING_OP_READ_MULTISHOT, linux 6.7, newer than some headers
+#define URING_OP_READ_MULTISHOT 49
+
+/*
+  One multishot read stays armed on the tty and fills buffers the
+  kernel takes from a ring of URING_BUFS provided ones, each completion
+  is copied into t->in and its buffer handed back. Reads then cost no
+  syscall at all, only arming it again after the buffers ran out does.
+  Kernels without it get one plain read in flight into the free part of
+  t->in instead. One write is in flight from the head of t->out.
+  Completions are picked up without a syscall, new entries go in with
+  one io_uring_enter per submit.
+
+  The multishot read needs the tty O_NONBLOCK, a blocking one never
+  reports the EIO of a child gone. Writes then fail EAGAIN on a full
+  tty and wait for POLLOUT before they go again.
+*/
+struct term_uring_t {
+    int fd, tty, fixed, multi, reading, writing, pending, err;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array,
+        *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    uint8_t *bufs;
+    void *sq, *cq;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+static struct io_uring_sqe *
+_sqe(struct term_uring_t *u) {
+    unsigned i = *u->sq_tail & *u->sq_mask;
+
+    ZERO(u->sqes[i]);
+    u->sq_array[i] = i;
+    return &u->sqes[i];
+}
+
+static void
+_push(struct term_uring_t *u) {
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+}
+
+static void
+_read(struct term_t *t) {
+    struct term_uring_t *u = t->uring;
+    struct io_uring_sqe *e;
+    int w;
+
+    if (u->reading || u->err || t->in.n == t->in.size)
+        return;
+    if (u->multi) {
+        e = _sqe(u);
+        e->opcode = URING_OP_READ_MULTISHOT;
+        e->fd = u->tty;
+        e->off = -1;
+        e->flags = IOSQE_BUFFER_SELECT;
+        e->buf_group = URING_GROUP;
+        e->user_data = URING_READ;
+        _push(u);
+        u->reading = 1;
+        return;
+    }
+    w = (t->in.r + t->in.n) % t->in.size;
+    e = _sqe(u);
+    e->opcode = u->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    e->fd = u->tty;
+    e->off = -1;
+    e->addr = (uintptr_t)(t->in.buf + w);
+    e->len = w >= t->in.r ? t->in.size - w : t->in.r - w;
+    e->user_data = URING_READ;
+    _push(u);
+    u->reading = 1;
+}
+
+// term_write only appends behind the write in flight, so its bytes
+// stay put until the completion
+static void
+_write(struct term_t *t) {
+    struct term_uring_t *u = t->uring;
+    struct io_uring_sqe *e;
+
+    if (u->writing || !t->out.n)
+        return;
+    e = _sqe(u);
+    e->opcode = IORING_OP_WRITE;
+    e->fd = u->tty;
+    e->off = -1;
+    e->addr = (uintptr_t)(t->out.buf + t->out.r);
+    e->len = MIN(t->out.n, t->out.size - t->out.r);
+    e->user_data = URING_WRITE;
+    _push(u);
+    u->writing = 1;
+    t->out.flushes++;
+}
+
+static void
+_poll(struct term_t *t) {
+    struct term_uring_t *u = t->uring;
+    struct io_uring_sqe *e;
+
+    e = _sqe(u);
+    e->opcode = IORING_OP_POLL_ADD;
+    e->fd = u->tty;
+    e->poll32_events = POLLOUT;
+    e->user_data = URING_POLL;
+    _push(u);
+}
+
+static void
+_wrote(struct term_t *t, int res) {
+    if (res == -EINTR)
+        return;
+    if (res < 0) {
+        if (res != -EIO)
+            LOGERR("failed to write tty: %s\n", strerror(-res));
+        t->out.n = 0;
+        return;
+    }
+    t->out.r = (t->out.r + res) % t->out.size;
+    t->out.n -= res;
+}
+
+void
+uring_submit(struct term_t *t) {
+    struct term_uring_t *u = t->uring;
+
+    _read(t);
+    _write(t);
+    if (!u->pending)
+        return;
+    t->syscalls++;
+    syscall(__NR_io_uring_enter, u->fd, u->pending, 0, 0, NULL, 0);
+    u->pending = 0;
+}
+
+// Copies a provided buffer into t->in and gives it back to the kernel
+static void
+_copy(struct term_t *t, struct io_uring_cqe *c) {
+    struct term_uring_t *u = t->uring;
+    struct io_uring_buf *b;
+    unsigned bid = c->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t *p = u->bufs + bid * URING_BUF;
+    int w = (t->in.r + t->in.n) % t->in.size, m;
+
+    m = MIN(c->res, t->in.size - w);
+    memcpy(t->in.buf + w, p, m);
+    memcpy(t->in.buf, p + m, c->res - m);
+    t->in.n += c->res;
+
+    b = &u->br->bufs[u->br->tail & (URING_BUFS-1)];
+    b->addr = (uintptr_t)p;
+    b->len = URING_BUF;
+    b->bid = bid;
+    __atomic_store_n(&u->br->tail, u->br->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Completions are read straight from the shared ring. A read that does
+// not fit t->in stays there until the parser made room.
+int
+uring_read(struct term_t *t) {
+    struct term_uring_t *u = t->uring;
+    struct io_uring_cqe *c;
+    unsigned head = *u->cq_head;
+
+    for (; head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE); head++) {
+        c = &u->cqes[head & *u->cq_mask];
+        if (c->user_data == URING_WRITE && c->res == -EAGAIN) {
+            _poll(t);
+            continue;
+        }
+        if (c->user_data == URING_WRITE || c->user_data == URING_POLL) {
+            u->writing = 0;
+            if (c->user_data == URING_WRITE)
+                _wrote(t, c->res);
+            continue;
+        }
+        if (c->flags & IORING_CQE_F_BUFFER &&
+            c->res > t->in.size - t->in.n)
+            break;
+        if (!(c->flags & IORING_CQE_F_MORE))
+            u->reading = 0;
+        if (c->flags & IORING_CQE_F_BUFFER) {
+            _copy(t, c);
+        } else if (c->res > 0) {
+            t->in.n += c->res;
+        } else if (u->multi && (c->res == -EINVAL || c->res == -EBADFD)) {
+            // the kernel has no multishot read for this file, plain
+            // reads do their own waiting and would only get EAGAIN
+            u->multi = 0;
+            ASSERT(fcntl(u->tty, F_SETFL,
+                fcntl(u->tty, F_GETFL) & ~O_NONBLOCK) >= 0);
+        } else if (c->res == -ENOBUFS) {
+            // the buffers ran out, it is armed again with the next submit
+        } else if (c->res != -EAGAIN && c->res != -EINTR) {
+            u->err = c->res ? -c->res : EIO;
+            if (u->err != EIO)
+                LOGERR("failed to read tty: %s\n", strerror(u->err));
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return u->err;
+}
+
+int
+uring_fd(struct term_t *t) {
+    return t->uring->fd;
+}
+
+long
+uring_mem(struct term_t *t) {
+    return t->uring && t->uring->multi ? URING_BUFS * (URING_BUF +
+        sizeof(struct io_uring_buf)) : 0;
+}
+
+void
+uring_free(struct term_t *t) {
+    struct term_uring_t *u = t->uring;
+
+    if (!u)
+        return;
+    close(u->fd);
+    free(u->br);
+    free(u->bufs);
+    munmap(u->sqes, u->sqes_len);
+    if (u->cq != u->sq)
+        munmap(u->cq, u->cq_len);
+    munmap(u->sq, u->sq_len);
+    free(u);
+    t->uring = NULL;
+}
+
+int
+uring_init(struct term_t *t) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct term_uring_t *u;
+    struct iovec iov;
+    int fd, i;
+
+    // every buffer can be a completion before any is reaped, the ring
+    // must not overflow
+    ZERO(p);
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 2*URING_BUFS;
+    if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        return errno;
+
+    ASSERT(u = calloc(1, sizeof(*u)));
+    u->fd = fd;
+    u->tty = t->tty;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_len = u->cq_len = MAX(u->sq_len, u->cq_len);
+
+    u->sq = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? u->sq :
+        mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ASSERT(u->sq != MAP_FAILED && u->cq != MAP_FAILED &&
+        u->sqes != MAP_FAILED);
+
+#define SQ(x) (unsigned*)((char*)u->sq + p.sq_off.x)
+#define CQ(x) (unsigned*)((char*)u->cq + p.cq_off.x)
+    u->sq_head = SQ(head);
+    u->sq_tail = SQ(tail);
+    u->sq_mask = SQ(ring_mask);
+    u->sq_array = SQ(array);
+    u->cq_head = CQ(head);
+    u->cq_tail = CQ(tail);
+    u->cq_mask = CQ(ring_mask);
+    u->cqes = (struct io_uring_cqe*)CQ(cqes);
+#undef SQ
+#undef CQ
+
+    if (!t->in.buf)
+        ASSERT(t->in.buf = malloc(t->in.size));
+    iov.iov_base = t->in.buf;
+    iov.iov_len = t->in.size;
+    u->fixed = !syscall(__NR_io_uring_register, fd,
+        IORING_REGISTER_BUFFERS, &iov, 1);
+
+    // the ring is page aligned, it is mapped by the kernel
+    ASSERT(!posix_memalign((void**)&u->br, 4096,
+        URING_BUFS * sizeof(struct io_uring_buf)));
+    ASSERT(u->bufs = malloc(URING_BUFS * URING_BUF));
+    ZERO(reg);
+    reg.ring_addr = (uintptr_t)u->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_GROUP;
+    u->multi = !syscall(__NR_io_uring_register, fd,
+        IORING_REGISTER_PBUF_RING, &reg, 1);
+    for (i = 0; i < URING_BUFS; i++) {
+        u->br->bufs[i].addr = (uintptr_t)(u->bufs + i * URING_BUF);
+        u->br->bufs[i].len = URING_BUF;
+        u->br->bufs[i].bid = i;
+    }
+    __atomic_store_n(&u->br->tail, URING_BUFS, __ATOMIC_RELEASE);
+
+    ASSERT(fcntl(t->tty, F_SETFL, u->multi ?
+        fcntl(t->tty, F_GETFL) | O_NONBLOCK :
+        fcntl(t->tty, F_GETFL) & ~O_NONBLOCK) >= 0);
+    t->uring = u;
+    uring_submit(t);
+    return 0;
+}
+
+#endif
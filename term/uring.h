@@ -0,0 +1,34 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "term.h"
+
+/*
+  io_uring backend for the tty, built with IO_URING=1 on linux. Reads
+  land in t->in from a multishot read into provided buffers, or through
+  a registered buffer where the kernel has none, writes go out from
+  t->out.
+  term_read and term_write_flush use it once uring_init succeeded,
+  otherwise they stay on the pselect path.
+*/
+#if defined(__linux) && defined(IO_URING)
+
+int uring_init(struct term_t*);
+void uring_free(struct term_t*);
+int uring_fd(struct term_t*);
+int uring_read(struct term_t*);
+void uring_submit(struct term_t*);
+long uring_mem(struct term_t*);
+
+#else
+
+#define uring_init(t)           ENOSYS
+#define uring_free(t)           do {} while (0)
+#define uring_fd(t)             -1
+#define uring_read(t)           ENOSYS
+#define uring_submit(t)         do {} while (0)
+#define uring_mem(t)            0L
+
+#endif
+
+#endif
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Generate width.h from the Unicode Character Database
+# usage: width.py UnicodeData.txt EastAsianWidth.txt emoji-data.txt
+
+import re
+import sys
+
+MAX = 0x110000
+BLOCK = 256
+
+# Format characters that are drawn: soft hyphen and the prepended
+# concatenation marks
+VISIBLE = {0x00ad, 0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605,
+           0x06dd, 0x070f, 0x0890, 0x0891, 0x08e2, 0x110bd, 0x110cd}
+
+def ranges(path):
+    for line in open(path, encoding='utf-8'):
+        line = line.split('#')[0].strip()
+        if not line:
+            continue
+        f = [x.strip() for x in line.split(';')]
+        a, _, b = f[0].partition('..')
+        yield int(a, 16), int(b or a, 16), f[1]
+
+def version(path):
+    for line in open(path, encoding='utf-8'):
+        m = re.search(r'-(\d+\.\d+\.\d+)\.txt', line)
+        if m:
+            return m.group(1)
+    return 'unknown'
+
+def main(unicodedata, eaw, emoji):
+    width = [1] * MAX
+
+    # Unassigned code points in these blocks default to wide
+    for a, b in [(0x3400, 0x4dbf), (0x4e00, 0x9fff), (0xf900, 0xfaff),
+                 (0x20000, 0x2fffd), (0x30000, 0x3fffd)]:
+        for c in range(a, b+1):
+            width[c] = 2
+
+    for a, b, v in ranges(eaw):
+        if v in ('W', 'F'):
+            for c in range(a, b+1):
+                width[c] = 2
+
+    for a, b, v in ranges(emoji):
+        if v == 'Emoji_Presentation':
+            for c in range(a, b+1):
+                width[c] = 2
+
+    first = None
+    for line in open(unicodedata, encoding='utf-8'):
+        f = line.split(';')
+        if len(f) < 3:
+            continue
+        c, name, cat = int(f[0], 16), f[1], f[2]
+        if name.endswith(', First>'):
+            first = c
+            continue
+        a = first if name.endswith(', Last>') else c
+        first = None
+        if cat in ('Mn', 'Me', 'Cf') and c not in VISIBLE:
+            for c in range(a, c+1):
+                width[c] = 0
+
+    # Hangul medial vowels and final consonants combine with the initial
+    for c in list(range(0x1160, 0x1200)) + list(range(0xd7b0, 0xd800)):
+        width[c] = 0
+    width[0x200b] = 0
+
+    blocks, stage1 = {}, []
+    for i in range(0, MAX, BLOCK):
+        w = width[i:i+BLOCK]
+        packed = tuple(w[j] | w[j+1] << 2 | w[j+2] << 4 | w[j+3] << 6
+            for j in range(0, BLOCK, 4))
+        stage1.append(blocks.setdefault(packed, len(blocks)))
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write('#ifndef __WIDTH_H__\n#define __WIDTH_H__\n\n')
+    out.write('// Generated by width.py from Unicode %s, do not edit\n\n'
+        % version(eaw))
+    out.write('#define WIDTH_BLOCK %d\n\n' % BLOCK)
+    out.write('static uint8_t width_stage1[%d] __unused = {\n' % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.write('   ' + ''.join(' %3d,' % x for x in stage1[i:i+16]) + '\n')
+    out.write('};\n\n')
+    out.write('static uint8_t width_stage2[][%d] __unused = {\n' % (BLOCK//4))
+    for b in sorted(blocks, key=blocks.get):
+        out.write('    {\n')
+        for i in range(0, len(b), 16):
+            out.write('       ' + ''.join(' 0x%02x,' % x for x in b[i:i+16])
+                + '\n')
+        out.write('    },\n')
+    out.write('};\n\n#endif\n')
+
+if __name__ == '__main__':
+    main(*sys.argv[1:4])
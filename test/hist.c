@@ -0,0 +1,51 @@
+#include "../bench/bench.h"
+
+/*
+  A snapshot scrolled back into the history decodes the styles of those
+  rows into its own table. The terminal's table, which a gc has emptied
+  of them, stays as it is, and every row of the snapshot still reads
+  back in the color it was written in.
+*/
+#define LINES                   200
+
+void term_style_gc(struct term_t*);
+
+int
+main(void) {
+    struct term_t t;
+    struct term_snap_t s = {0};
+    struct term_style_t *st;
+    char line[64];
+    int i, n, gen, y, failed = 0;
+
+    bench_term(&t, 10, 40);
+    for (i = 0; i < LINES; i++) {
+        n = sprintf(line, "\033[38;2;%d;%d;0mline %d\r\n", i, 255 - i, i);
+        _term_read(&t, (uint8_t*)line, n);
+    }
+    _term_read(&t, (uint8_t*)"\033[0m\033[2J", 8);
+    term_style_gc(&t);
+    n = t.style.n;
+    gen = t.style.gen;
+
+    term_view(&t, t.row);
+    term_snap(&t, &s);
+    if (t.style.n != n || t.style.gen != gen) {
+        printf("hist: snapshot changed the styles, %d of %d, gen %d of %d\n",
+            t.style.n, n, t.style.gen, gen);
+        failed = 1;
+    }
+    for (y = 0; y < t.row && !failed; y++) {
+        i = t.hist.n - t.row + y;
+        st = &s.style.buf[s.cells[y * s.col].style];
+        if (st->fg.type != 24 || st->fg.r != i || st->fg.g != 255 - i) {
+            printf("hist: row %d has %d,%d and not %d,%d\n", y, st->fg.r,
+                st->fg.g, i, 255 - i);
+            failed = 1;
+        }
+    }
+    printf("hist: %s\n", failed ? "FAILED" : "ok");
+    term_snap_free(&s);
+    term_free(&t);
+    return failed;
+}
@@ -0,0 +1,255 @@
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "../bench/bench.h"
+#include "../term/log.h"
+
+/*
+  The session log as it is on disk after term_free: the lines in order,
+  clusters spelled out, and an index entry at the start of each line.
+  A writer stuck on a full pipe makes log_push drop lines, which have
+  to come back as markers holding one index entry per dropped line.
+  A name already taken is not appended to.
+*/
+#define DROP_LINES              300000
+
+static int failed;
+
+// Reads the log of dir into buf, its index into off, returns the lines
+static long
+load(char *dir, char *buf, long size, uint64_t *off, long noff, long *n) {
+    char path[PATH_MAX];
+    struct dirent *e;
+    DIR *d;
+    FILE *f;
+    long lines = 0;
+
+    *n = 0;
+    ASSERT(d = opendir(dir));
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        ASSERT(f = fopen(path, "r"));
+        if (strstr(e->d_name, ".idx"))
+            lines = fread(off, sizeof(*off), noff, f);
+        else
+            *n = fread(buf, 1, size-1, f);
+        fclose(f);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+    buf[*n] = 0;
+    return lines;
+}
+
+static void
+check(char *name, char *dir, char *want) {
+    static char buf[1<<16];
+    static uint64_t off[1024];
+    long lines, n, i, k;
+
+    lines = load(dir, buf, sizeof(buf), off, LEN(off), &n);
+    if (strcmp(buf, want)) {
+        printf("log: %s reads \"%s\"\n", name, buf);
+        failed = 1;
+    }
+    for (i = 0, k = 0; i < lines; i++) {
+        if ((long)off[i] != k) {
+            printf("log: %s line %ld indexed at %ld, not %ld\n", name, i,
+                (long)off[i], k);
+            failed = 1;
+            break;
+        }
+        for (; k < n && buf[k] != '\n'; k++);
+        k++;
+    }
+}
+
+static void
+feed(struct term_t *t, char *s) {
+    _term_read(t, (uint8_t*)s, strlen(s));
+}
+
+// Leaving under the alternate screen logs the primary rows, with their
+// clusters and not the ones at the same offsets on the alternate screen
+static void
+exit_alt(void) {
+    struct term_t t;
+    char dir[] = "/tmp/zt-log-XXXXXX";
+
+    ASSERT(mkdtemp(dir));
+    bench_term(&t, 6, 20);
+    ASSERT(!log_init(&t, dir));
+    feed(&t, "A\xcc\x81 B\xcc\x81\r\n$ top");
+    feed(&t, "\033[?1049hx\xcc\xa3 y\xcc\xa3");
+    term_free(&t);
+    check("exit under alt", dir, "A\xcc\x81 B\xcc\x81\n$ top\n");
+}
+
+// A log name already in use, with an index of its own, is left alone
+// and the new log and index start empty
+static void
+reuse(void) {
+    char dir[] = "/tmp/zt-log-XXXXXX", path[PATH_MAX], buf[64];
+    struct term_t t;
+    struct dirent *e;
+    long now = time(NULL), n;
+    DIR *d;
+    FILE *f;
+    int i, logs = 0;
+
+    ASSERT(mkdtemp(dir));
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/zt-%ld-%d.log%s", dir, now + i/2,
+            (int)getpid(), i % 2 ? ".idx" : "");
+        ASSERT(f = fopen(path, "w"));
+        fputs("stale\n", f);
+        fclose(f);
+    }
+    bench_term(&t, 6, 20);
+    ASSERT(!log_init(&t, dir));
+    feed(&t, "hello");
+    term_free(&t);
+
+    ASSERT(d = opendir(dir));
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        ASSERT(f = fopen(path, "r"));
+        n = fread(buf, 1, sizeof(buf)-1, f);
+        buf[n] = 0;
+        fclose(f);
+        unlink(path);
+        if (!strcmp(buf, "stale\n"))
+            continue;
+        logs++;
+        if (strstr(e->d_name, ".idx") ? n != 8 || memcmp(buf, "\0\0\0\0"
+            "\0\0\0\0", 8) : strcmp(buf, "hello\n")) {
+            printf("log: reuse, %s reads \"%s\"\n", e->d_name, buf);
+            failed = 1;
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+    if (logs != 2) {
+        printf("log: reuse, %d new files\n", logs);
+        failed = 1;
+    }
+}
+
+static struct {
+    char *buf;
+    long n, size;
+    int fd;
+} pipe_data;
+
+static void *
+drain(void *arg __unused) {
+    long ret;
+
+    for (;;) {
+        if (pipe_data.n == pipe_data.size) {
+            pipe_data.size = MAX(pipe_data.size*2, 1<<20);
+            ASSERT(pipe_data.buf = realloc(pipe_data.buf, pipe_data.size));
+        }
+        ret = read(pipe_data.fd, pipe_data.buf + pipe_data.n,
+            pipe_data.size - pipe_data.n);
+        if (ret <= 0)
+            return NULL;
+        pipe_data.n += ret;
+    }
+}
+
+// The log file descriptor is found in /proc and replaced with a pipe
+// that nobody reads yet
+static int
+stall(char *dir) {
+    char path[PATH_MAX], link[PATH_MAX];
+    struct dirent *e;
+    DIR *d;
+    long n;
+    int fd = -1, p[2];
+
+    ASSERT(d = opendir("/proc/self/fd"));
+    while ((e = readdir(d))) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%s", e->d_name);
+        if ((n = readlink(path, link, sizeof(link)-1)) < 0)
+            continue;
+        link[n] = 0;
+        if (!strncmp(link, dir, strlen(dir)) && !strstr(link, ".idx"))
+            fd = atoi(e->d_name);
+    }
+    closedir(d);
+    ASSERT(fd >= 0 && !pipe(p));
+    ASSERT(dup2(p[1], fd) == fd);
+    close(p[1]);
+    return p[0];
+}
+
+// Every marker line has as many index entries as lines it stands for,
+// every other line one
+static void
+drops(void) {
+    char dir[] = "/tmp/zt-log-XXXXXX", line[128];
+    uint64_t *off;
+    struct term_t t;
+    pthread_t reader;
+    long i, k, n, lines, dropped, entries, e, want;
+    char *p;
+
+    ASSERT(mkdtemp(dir));
+    bench_term(&t, 6, 100);
+    ASSERT(!log_init(&t, dir));
+    pipe_data.fd = stall(dir);
+    for (i = 0; i < DROP_LINES; i++) {
+        n = sprintf(line, "line %ld ", i);
+        memset(line + n, '.', 80);
+        memcpy(line + n + 80, "\r\n", 2);
+        _term_read(&t, (uint8_t*)line, n + 82);
+    }
+    dropped = log_dropped(&t);
+    ASSERT(!pthread_create(&reader, NULL, drain, NULL));
+    lines = log_lines(&t);
+    term_free(&t);
+    pthread_join(reader, NULL);
+    close(pipe_data.fd);
+
+    ASSERT(off = malloc((lines + 64) * sizeof(*off)));
+    entries = load(dir, line, sizeof(line), off, lines + 64, &n);
+    if (!dropped) {
+        printf("log: drops, nothing dropped\n");
+        failed = 1;
+    }
+    for (i = 0, e = 0; i < pipe_data.n && !failed; i = k+1) {
+        for (k = i; k < pipe_data.n && pipe_data.buf[k] != '\n'; k++);
+        p = pipe_data.buf + i;
+        want = 1;
+        if (!strncmp(p, "[zt: ", 5))
+            want = atol(p + 5);
+        for (; want > 0 && e < entries && (long)off[e] == i; want--, e++);
+        if (want) {
+            printf("log: drops, line at %ld short of index entries\n", i);
+            failed = 1;
+        }
+    }
+    if (!failed && (e != entries || entries < lines)) {
+        printf("log: drops, %ld index entries for %ld lines\n", entries, e);
+        failed = 1;
+    }
+    printf("log: %ld of %ld lines dropped\n", dropped, lines);
+    free(pipe_data.buf);
+    free(off);
+}
+
+int
+main(void) {
+    exit_alt();
+    reuse();
+    drops();
+    printf("log: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,76 @@
+#include "../bench/bench.h"
+
+/*
+  A burst far larger than IN_BUDGET through term_read the way the zt
+  main loop calls it: every call has to come back within IN_BUDGET_TIME
+  so that drawing and keys are not starved. The burst mixes the slow
+  paths, SGR and CJK text, scrolling into history, and line and screen
+  edits. Time is the thread's cpu time, so that other processes on the
+  machine do not count against a call.
+*/
+#define BURST                   (32L<<20)
+
+static char *cjk[] = {"漢字", "日本語の", "テキスト", "中文", "한국어"};
+static char *edit[] = {"\033[5;1H\033[10L", "\033[5;1H\033[10M",
+    "\033[10;1H\033[20@", "\033[H\033[2J", "\033[10;5H\033[K"};
+
+static long
+burst(uint8_t *buf) {
+    uint32_t s = 1;
+    long n = 0;
+    int x;
+
+    while (n < BURST - 512) {
+        if (bench_rand(&s) % 64 == 0)
+            n += sprintf((char*)buf + n, "%s", edit[bench_rand(&s) % LEN(edit)]);
+        for (x = 0; x < 150; x += 12)
+            n += sprintf((char*)buf + n, "\033[%d;%dm%s word ",
+                bench_rand(&s) % 2, 31 + bench_rand(&s) % 7,
+                cjk[bench_rand(&s) % LEN(cjk)]);
+        buf[n++] = '\r';
+        buf[n++] = '\n';
+    }
+    return n;
+}
+
+static long
+cpu(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * SECOND + ts.tv_nsec;
+}
+
+int
+main(void) {
+    struct term_t t;
+    uint8_t *buf;
+    long n, calls = 0, over = 0, max = 0, wall = 0, start, c, w;
+    int failed;
+
+    ASSERT(buf = malloc(BURST));
+    n = burst(buf);
+    bench_term(&t, 50, 200);
+    bench_tty(&t, buf, n);
+
+    start = get_time();
+    do {
+        c = cpu();
+        w = get_time();
+        term_read(&t);
+        c = cpu() - c;
+        wall = MAX(wall, get_time() - w);
+        max = MAX(max, c);
+        over += c > IN_BUDGET_TIME;
+        calls++;
+    } while (term_pending(&t) || lseek(t.tty, 0, SEEK_CUR) < n);
+
+    failed = over > 0;
+    printf("read: %s, %ld calls over %.1f ms of %ld, %.2f ms cpu max, "
+        "%.2f ms wall max, %.1f MB/s\n", failed ? "FAILED" : "ok", over,
+        IN_BUDGET_TIME / 1e6, calls, max / 1e6, wall / 1e6,
+        bench_mbs(n, start));
+    term_free(&t);
+    free(buf);
+    return failed;
+}
@@ -0,0 +1,105 @@
+#include "../bench/bench.h"
+#include "../term/hist.h"
+
+/*
+  Resizes that reflow the primary screen: rows pushed to the scrollback
+  and rows kept on screen have to come back with their text, clusters
+  included, whichever screen is up, and the saved cursor has to stay
+  on the character it was saved on.
+*/
+static int failed;
+
+// Row text as UTF-32 with clusters spelled out, trailing blanks cut
+static int
+text(struct term_t *t, struct term_char_t *l, struct term_cluster_t *a,
+    uint32_t *u) {
+    int x, n = 0, k, i;
+
+    for (x = 0; x < t->col; x++) {
+        if (l[x].c & CHAR_CLUSTER && a) {
+            k = a->buf[l[x].c & ~CHAR_CLUSTER];
+            for (i = 0; i < k; i++)
+                u[n++] = a->buf[(l[x].c & ~CHAR_CLUSTER) + 1 + i];
+        } else {
+            u[n++] = l[x].c;
+        }
+    }
+    for (; n > 0 && u[n-1] == ' '; n--);
+    return n;
+}
+
+static void
+expect(char *name, uint32_t *u, int n, uint32_t *want, int m) {
+    if (n == m && !memcmp(u, want, n * sizeof(*u)))
+        return;
+    printf("reflow: %s differs:", name);
+    for (int i = 0; i < n; i++)
+        printf(" %x", u[i]);
+    printf("\n");
+    failed = 1;
+}
+
+static void
+feed(struct term_t *t, char *s) {
+    _term_read(t, (uint8_t*)s, strlen(s));
+}
+
+// Clusters of the primary screen pushed to the scrollback while the
+// alternate screen, with clusters of its own, is up
+static void
+alt_clusters(void) {
+    static uint32_t want[] = {'A', 0x301, ' ', 'B', 0x301};
+    struct term_t t;
+    struct term_char_t l[40];
+    struct term_cluster_t a = {0};
+    struct term_styles_t st = {0};
+    uint32_t u[128];
+    int n;
+
+    bench_term(&t, 6, 20);
+    feed(&t, "A\xcc\x81 B\xcc\x81\r\n1\r\n2\r\n3\r\n4\r\n5");
+    feed(&t, "\033[?1049hx\xcc\xa3 y\xcc\xa3");
+    term_line_resize(&t, 3, 20);
+    if (hist_get(&t, 0, l, &a, &st)) {
+        printf("reflow: alt clusters, nothing in the scrollback\n");
+        failed = 1;
+    } else {
+        n = text(&t, l, &a, u);
+        expect("alt clusters scrollback", u, n, want, LEN(want));
+    }
+    free(a.buf);
+    free(st.buf);
+    term_free(&t);
+}
+
+// The same rows kept on screen, read back after leaving the alternate
+// screen
+static void
+alt_rejoin(void) {
+    static uint32_t want[] = {'A', 0x301, ' ', 'B', 0x301, ' ', 'c', 'd',
+        'e', 'f', 'g', 'h'};
+    struct term_t t;
+    uint32_t u[128];
+    int n;
+
+    bench_term(&t, 6, 8);
+    feed(&t, "A\xcc\x81 B\xcc\x81 cdefgh\r\n$ ");
+    feed(&t, "\033[?1049hx\xcc\xa3 y\xcc\xa3");
+    term_line_resize(&t, 6, 20);
+    feed(&t, "\033[?1049l");
+    n = text(&t, term_line_row(&t, 0), t.cluster, u);
+    expect("alt rejoin", u, n, want, LEN(want));
+    if (t.y != 1 || t.x != 2) {
+        printf("reflow: alt rejoin, cursor at %d,%d\n", t.y, t.x);
+        failed = 1;
+    }
+    term_free(&t);
+}
+
+int
+main(void) {
+    alt_clusters();
+    alt_rejoin();
+    printf("reflow: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,179 @@
+#include <limits.h>
+#include <sys/wait.h>
+
+#include "../bench/bench.h"
+#include "../term/log.h"
+
+/*
+  Memory has to level off in a long session. The same workload is
+  replayed through a terminal with scrollback, session log and a
+  snapshot per chunk, the way zt draws. After the warm up passes the
+  resident size may not grow by more than GROWTH, and may not exceed
+  the start plus what term_mem accounts for by more than SLACK.
+
+  With DISPLAY set and zt built, zt itself is run with this program as
+  its shell replaying the workload, and its resident size is sampled
+  against ZT_CEILING.
+*/
+#define PASS                    (16L<<20)
+#define PASSES                  8
+#define WARM                    2
+#define GROWTH                  (2L<<20)
+#define SLACK                   (8L<<20)
+#define ZT_CEILING              (160L<<20)
+
+static char *cjk[] = {"漢字", "日本語の", "テキスト", "中文", "한국어"};
+
+// Build output, colored logs, wrapped long lines, clusters and now and
+// then a full screen program on the alternate screen
+static long
+workload(uint8_t *buf) {
+    uint32_t s = 1;
+    long n = 0;
+    int x, k;
+
+    while (n < PASS - 4096) {
+        switch (bench_rand(&s) % 16) {
+        case 0:
+            n += sprintf((char*)buf + n, "\033[?1049h\033[H\033[2J");
+            for (k = 0; k < 50; k++)
+                n += sprintf((char*)buf + n, "\033[%d;1H\033[4%dm%*d",
+                    k+1, bench_rand(&s) % 8, 120, k);
+            n += sprintf((char*)buf + n, "\033[0m\033[?1049l");
+            break;
+        case 1:
+            for (x = 0; x < 600; x++)
+                buf[n++] = 'a' + bench_rand(&s) % 26;
+            break;
+        case 2:
+            for (x = 0; x < 40; x++)
+                n += sprintf((char*)buf + n, "e\xcc\x81\xcc\xa3 ");
+            break;
+        case 3:
+            n += sprintf((char*)buf + n, "\033]0;job %u\007",
+                bench_rand(&s) % 1000);
+            break;
+        default:
+            for (x = 0; x < 150; x += 12)
+                n += sprintf((char*)buf + n, "\033[%d;38;2;%u;%u;%um%s word ",
+                    bench_rand(&s) % 2, bench_rand(&s) % 256,
+                    bench_rand(&s) % 256, bench_rand(&s) % 256,
+                    cjk[bench_rand(&s) % LEN(cjk)]);
+            n += sprintf((char*)buf + n, "\033[0m");
+        }
+        buf[n++] = '\r';
+        buf[n++] = '\n';
+    }
+    return n;
+}
+
+// VmRSS in bytes, of this process for pid 0
+static long
+rss(pid_t pid) {
+    char path[64], line[256];
+    long kb = -1;
+    FILE *f;
+
+    if (pid)
+        snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    else
+        snprintf(path, sizeof(path), "/proc/self/status");
+    if (!(f = fopen(path, "r")))
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb < 0 ? -1 : kb << 10;
+}
+
+static int
+core(uint8_t *buf, long n) {
+    struct term_t t;
+    struct term_snap_t snap = {0};
+    struct term_mem_t m;
+    char dir[] = "/tmp/zt-rss-XXXXXX", cmd[64];
+    long start, r[PASSES], total, i;
+    int p, failed;
+
+    ASSERT(mkdtemp(dir));
+    bench_term(&t, 50, 200);
+    ASSERT(!log_init(&t, dir));
+    start = rss(0);
+    for (p = 0; p < PASSES; p++) {
+        for (i = 0; i < n; i += IN_CHUNK) {
+            _term_read(&t, buf + i, MIN(IN_CHUNK, n - i));
+            term_snap(&t, &snap);
+        }
+        r[p] = rss(0);
+    }
+    total = term_mem(&t, &snap, &m);
+
+    failed = r[PASSES-1] > r[WARM-1] + GROWTH ||
+        r[PASSES-1] > start + total + SLACK;
+    printf("rss: %s, %.1f MB after warm up, %.1f MB at the end, "
+        "%.1f MB start + %.1f MB accounted\n", failed ? "FAILED" : "ok",
+        r[WARM-1] / 1e6, r[PASSES-1] / 1e6, start / 1e6, total / 1e6);
+
+    term_free(&t);
+    term_snap_free(&snap);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    (void)!system(cmd);
+    return failed;
+}
+
+static int
+zt(char *self) {
+    long n = 0, max = 0, mid = 0, last = 0, v;
+    pid_t pid;
+
+    if (!getenv("DISPLAY") || access("./zt", X_OK)) {
+        printf("rss: zt skipped, needs DISPLAY and ./zt\n");
+        return 0;
+    }
+    ASSERT((pid = fork()) != -1);
+    if (!pid) {
+        setenv("SHELL", self, 1);
+        setenv("ZT_RSS_REPLAY", "1", 1);
+        execl("./zt", "zt", NULL);
+        _exit(1);
+    }
+    // sampled until the replay ends and zt with it
+    while (waitpid(pid, NULL, WNOHANG) == 0) {
+        if ((v = rss(pid)) > 0) {
+            last = v;
+            max = MAX(max, v);
+            if (++n == 20)
+                mid = v;
+        }
+        usleep(100000);
+    }
+    printf("rss: zt %s, %.1f MB max, %.1f MB after warm up, %.1f MB last\n",
+        max > ZT_CEILING || (mid && last > mid + GROWTH) ? "FAILED" : "ok",
+        max / 1e6, mid / 1e6, last / 1e6);
+    return max > ZT_CEILING || (mid && last > mid + GROWTH);
+}
+
+int
+main(int argc __unused, char **argv) {
+    char self[PATH_MAX];
+    uint8_t *buf;
+    long n, k, ret;
+    int p, failed;
+
+    ASSERT(buf = malloc(PASS));
+    n = workload(buf);
+    // run by zt as its shell
+    if (getenv("ZT_RSS_REPLAY")) {
+        for (p = 0; p < PASSES; p++)
+            for (k = 0; k < n; k += ret)
+                if ((ret = write(1, buf + k, n - k)) <= 0)
+                    return 1;
+        return 0;
+    }
+
+    failed = core(buf, n);
+    free(buf);
+    ASSERT(realpath(argv[0], self));
+    return zt(self) || failed;
+}
@@ -0,0 +1,174 @@
+#include "../bench/bench.h"
+
+/*
+  Every vector kernel against the scalar one on the same random input,
+  at each level the cpu has. Inputs mix the bytes each kernel branches
+  on and start at odd offsets so that blocks straddle the edges.
+*/
+#define ROUNDS                  20000
+#define SIZE                    512
+
+struct kernels {
+    int (*ascii_span)(uint8_t*, int);
+    int (*str_span)(uint8_t*, int);
+    int (*utf8_decode)(uint8_t*, int, uint32_t*, int, int*);
+    int (*base64_decode)(uint8_t*, int, uint8_t*, int*);
+    long (*find)(uint8_t*, long, uint8_t*, int);
+};
+
+static char *levels[] = {"c", "sse2", "ssse3", "avx2"};
+static uint32_t seed = 1;
+static int failed;
+
+static void
+get(struct kernels *k, int level) {
+    simd_level(level);
+    k->ascii_span = simd_ascii_span;
+    k->str_span = simd_str_span;
+    k->utf8_decode = simd_utf8_decode;
+    k->base64_decode = simd_base64_decode;
+    k->find = simd_find;
+}
+
+static void
+fail(char *kernel, int level, int round) {
+    printf("simd: %s %s differs from c in round %d\n",
+        kernel, levels[level], round);
+    failed = 1;
+}
+
+// Mostly printable ASCII, sometimes a byte from around the edges
+static int
+text(uint8_t *p) {
+    static uint8_t edge[] = {0x00, 0x09, 0x1b, 0x1f, 0x20, 0x7e, 0x7f,
+        0x80, 0xc2, 0xe2, 0xff};
+    int i, n = bench_rand(&seed) % SIZE;
+
+    for (i = 0; i < n; i++)
+        p[i] = bench_rand(&seed) % 64 ? 0x20 + bench_rand(&seed) % 0x5f :
+            edge[bench_rand(&seed) % LEN(edge)];
+    return n;
+}
+
+// Runs of valid sequences of each length with overlong, surrogate,
+// truncated and stray bytes in between
+static int
+utf8(uint8_t *p) {
+    static char *bad[] = {"\xc0\xaf", "\xe0\x80\xaf", "\xed\xa0\x80",
+        "\xf4\x90\x80\x80", "\x80", "\xe2\x82", "\x1b", "\xff"};
+    int n = 0, run, len, i;
+    uint32_t u;
+    char *s;
+
+    while (n < SIZE - 64) {
+        if (bench_rand(&seed) % 16 == 0) {
+            s = bad[bench_rand(&seed) % LEN(bad)];
+            memcpy(p + n, s, strlen(s));
+            n += strlen(s);
+            continue;
+        }
+        len = 1 + bench_rand(&seed) % 4;
+        for (run = bench_rand(&seed) % 40; run > 0 && n < SIZE - 8; run--) {
+            switch (len) {
+            case 1: p[n++] = 0x20 + bench_rand(&seed) % 0x5f; break;
+            case 2:
+                u = 0x80 + bench_rand(&seed) % 0x780;
+                p[n++] = 0xc0 | u >> 6;
+                p[n++] = 0x80 | (u & 0x3f);
+                break;
+            case 3:
+                u = 0x800 + bench_rand(&seed) % 0xf800;
+                if (u >= 0xd800 && u <= 0xdfff)
+                    u -= 0x800;
+                p[n++] = 0xe0 | u >> 12;
+                p[n++] = 0x80 | (u >> 6 & 0x3f);
+                p[n++] = 0x80 | (u & 0x3f);
+                break;
+            case 4:
+                u = 0x10000 + bench_rand(&seed) % 0x100000;
+                p[n++] = 0xf0 | u >> 18;
+                p[n++] = 0x80 | (u >> 12 & 0x3f);
+                p[n++] = 0x80 | (u >> 6 & 0x3f);
+                p[n++] = 0x80 | (u & 0x3f);
+                break;
+            }
+        }
+    }
+    // cut anywhere, sequences included
+    i = bench_rand(&seed) % (n+1);
+    return i;
+}
+
+static int
+base64(uint8_t *p) {
+    static char alpha[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i, n = 4 * (bench_rand(&seed) % (SIZE/4));
+
+    for (i = 0; i < n; i++)
+        p[i] = alpha[bench_rand(&seed) % 64];
+    switch (bench_rand(&seed) % 6) {
+    case 0: if (n >= 1) p[n-1] = '='; break;
+    case 1: if (n >= 2) p[n-1] = p[n-2] = '='; break;
+    case 2: if (n) p[bench_rand(&seed) % n] = "=\n -\x1b"[bench_rand(&seed) % 5]; break;
+    case 3: n -= n ? bench_rand(&seed) % 4 : 0; break;
+    }
+    return n;
+}
+
+static void
+check(int level, struct kernels *c, struct kernels *v) {
+    static uint8_t buf[SIZE + 64], out[2][SIZE + 64];
+    static uint32_t u[2][SIZE + 64];
+    uint8_t *p, s[8];
+    int r, n, m, a, b, ka, kb, cap;
+
+    for (r = 0; r < ROUNDS && !failed; r++) {
+        p = buf + r % 7;
+
+        n = text(p);
+        if (c->ascii_span(p, n) != v->ascii_span(p, n))
+            fail("ascii_span", level, r);
+        if (c->str_span(p, n) != v->str_span(p, n))
+            fail("str_span", level, r);
+
+        n = utf8(p);
+        cap = bench_rand(&seed) % 2 ? SIZE : 1 + bench_rand(&seed) % 64;
+        a = c->utf8_decode(p, n, u[0], cap, &ka);
+        b = v->utf8_decode(p, n, u[1], cap, &kb);
+        if (a != b || ka != kb || memcmp(u[0], u[1], ka * sizeof(**u)))
+            fail("utf8_decode", level, r);
+
+        n = base64(p);
+        a = c->base64_decode(p, n, out[0], &ka);
+        b = v->base64_decode(p, n, out[1], &kb);
+        if (a != b || ka != kb || memcmp(out[0], out[1], ka))
+            fail("base64_decode", level, r);
+
+        // a small alphabet so that partial matches are common
+        n = bench_rand(&seed) % SIZE;
+        for (a = 0; a < n; a++)
+            p[a] = 'a' + bench_rand(&seed) % 3;
+        m = 1 + bench_rand(&seed) % LEN(s);
+        for (a = 0; a < m; a++)
+            s[a] = 'a' + bench_rand(&seed) % 3;
+        if (c->find(p, n, s, m) != v->find(p, n, s, m))
+            fail("find", level, r);
+    }
+}
+
+int
+main(void) {
+    struct kernels c, v;
+    int level, max;
+
+    get(&c, SIMD_C);
+    max = simd_level(SIMD_AVX2);
+    for (level = SIMD_SSE2; level <= max; level++) {
+        get(&v, level);
+        check(level, &c, &v);
+    }
+    printf("simd: %s, %d rounds up to %s\n", failed ? "FAILED" : "ok",
+        ROUNDS, levels[max]);
+    return failed;
+}
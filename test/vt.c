@@ -0,0 +1,40 @@
+#include "../bench/bench.h"
+
+/*
+  A byte of UTF-8 text inside an escape or control sequence cancels the
+  sequence and is printed. What follows it is text again, so that ESC é c
+  does not reset the terminal nor CSI é 2J clear it.
+*/
+static struct {
+    char *seq;
+    uint32_t want[8];
+} cases[] = {
+    {"\033\xc3\xa9" "c", {'a', 'b', 0xe9, 'c'}},
+    {"\033(\xc3\xa9" "B", {'a', 'b', 0xe9, 'B'}},
+    {"\033[\xc3\xa9" "2J", {'a', 'b', 0xe9, '2', 'J'}},
+    {"\033[1;\xc3\xa9" "m", {'a', 'b', 0xe9, 'm'}},
+};
+
+int
+main(void) {
+    struct term_t t;
+    struct term_char_t *l;
+    int i, x, failed = 0;
+
+    for (i = 0; i < (int)LEN(cases); i++) {
+        bench_term(&t, 4, 20);
+        _term_read(&t, (uint8_t*)"ab", 2);
+        _term_read(&t, (uint8_t*)cases[i].seq, strlen(cases[i].seq));
+        l = term_line_row(&t, 0);
+        for (x = 0; x < 8 && l[x].c == (cases[i].want[x] ?
+            cases[i].want[x] : ' '); x++);
+        if (x < 8 || t.ctrl.state) {
+            printf("vt: case %d has U+%04x at %d in state %d\n", i, l[x].c,
+                x, t.ctrl.state);
+            failed = 1;
+        }
+        term_free(&t);
+    }
+    printf("vt: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,64 @@
+#include "../bench/bench.h"
+
+/*
+  Text written in bulk has to leave the screen as the byte by byte
+  path does: the same characters, clusters, widths and styles in every
+  cell and the cursor in the same place. Pieces mix wide, combining and
+  ZWJ sequences with ASCII and are cut at random row widths, so that
+  wide characters wrap and clusters straddle the bulk spans.
+*/
+#define ROUNDS                  200
+#define SIZE                    20000
+
+static char *pieces[] = {
+    "漢", "字", " ", "a", "é", "ö", "e\xcc\x81", "\xcc\xa3", "\xe2\x80\x8d",
+    "\xe2\x80\x8b", "\xe3\x80\x80", "\xef\xbc\xa1", "👍",
+    "\xf0\x9f\x91\xa8\xe2\x80\x8d\xf0\x9f\x91\xa9", "\033[31m", "\r\n",
+};
+
+static int
+differ(struct term_t *a, struct term_t *b) {
+    struct term_char_t *la, *lb;
+    uint32_t *pa, *pb;
+    int x, y, ka, kb;
+
+    for (y = 0; y < a->row; y++) {
+        la = term_line_row(a, y);
+        lb = term_line_row(b, y);
+        for (x = 0; x < a->col; x++) {
+            pa = term_char(a, &la[x], &ka);
+            pb = term_char(b, &lb[x], &kb);
+            if (ka != kb || memcmp(pa, pb, ka * sizeof(*pa)) ||
+                la[x].width != lb[x].width || la[x].style != lb[x].style)
+                return 1;
+        }
+    }
+    return a->x != b->x || a->y != b->y;
+}
+
+int
+main(void) {
+    static uint8_t buf[SIZE + 64];
+    struct term_t a, b;
+    uint32_t s = 1;
+    int r, i, n, failed = 0;
+
+    for (r = 0; r < ROUNDS && !failed; r++) {
+        for (n = 0; n < SIZE;)
+            n += sprintf((char*)buf + n, "%s",
+                pieces[bench_rand(&s) % LEN(pieces)]);
+        bench_term(&a, 10, 7 + r % 13);
+        bench_term(&b, 10, 7 + r % 13);
+        _term_read(&a, buf, n);
+        for (i = 0; i < n; i++)
+            _term_read(&b, buf + i, 1);
+        if (differ(&a, &b)) {
+            printf("write: round %d differs from byte by byte\n", r);
+            failed = 1;
+        }
+        term_free(&a);
+        term_free(&b);
+    }
+    printf("write: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -1,5 +1,8 @@
 #include <getopt.h>
 #include <locale.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/select.h>
 
 #include <X11/Xlib.h>
@@ -8,10 +11,17 @@
 #include <X11/cursorfont.h>
 
 #include "term/term.h"
+#include "term/simd.h"
+#include "term/uring.h"
+#include "term/log.h"
+#include "term/shm.h"
+#include "term/paste.h"
 
 #define FOREGROUND "white"
 #define BACKGROUND "gray20"
 #define LATENCY (10 * MILLISECOND)
+// Xft's default cap on the glyph cache of one font
+#define GLYPH_MEM (1<<20)
 
 static struct {
     char *name;
@@ -56,16 +66,45 @@ struct {
     XftGlyphFontSpec *specs;
     XIM im;
     XIC ic;
-    int screen, depth, nspec, fw, fh, fb,
-        nfont, fontcap, width, height, xfd;
+    int screen, depth, nspec, speccap, fw, fh, fb,
+        nfont, fontcap, width, height, pixw, pixh, xfd;
+    struct {
+        int w, h, pending;
+    } resize;
     struct {
         XftFont *font;
         int weight, slant;
     } *fonts;
+    struct {
+        Atom clipboard, targets, utf8;
+        uint8_t *buf, *data, q[4];
+        int n, size, ndata, nq, body, err, want, own;
+    } sel;
+    struct {
+        Atom prop, incr;
+        struct term_paste_t q;
+        long off;
+        int state, ready;
+    } paste;
+    // term is shared with the parser thread under lock, frames are
+    // announced on wake and drawn from snap
+    struct term_snap_t snap;
+    struct {
+        char q[256];
+        int on, n;
+        long line;
+    } search;
+    char title[256];
+    pthread_t parser;
+    pthread_mutex_t lock;
+    int wake[2], frame, quit, stats, waiting;
     struct {
         double fontsize;
         char *term;
-        int debug, no_ignore;
+        char *log;
+        char *shm;
+        int debug, no_ignore, string_max, input_size, io_uring,
+            hist_lines, hist_mem, font_mem, stats;
     } arg;
 } zt = {0};
 struct term_t term = {0};
@@ -97,7 +136,8 @@ xcolor_free(XftColor *c) {
 }
 
 void
-xdraw_specs(struct term_char_t c) {
+xdraw_specs(struct term_char_t c, int x1) {
+    struct term_style_t *s = &zt.snap.style.buf[c.style];
     XftColor bg, fg, a;
     int x, y, w, rf, rb, t;
 
@@ -108,40 +148,40 @@ xdraw_specs(struct term_char_t c) {
     bg = zt.bkg;
     y = zt.specs[0].y - zt.fb;
     x = zt.specs[0].x;
-    w = zt.nspec * c.width * zt.fw;
+    w = x1 - x;
     rf = rb = 1;
 
     t = zt.width - x - w;
     if (t > 0 && t < zt.fw)
         w = zt.width-x;
 
-    if (!MODE_ISSET(&c, CHAR_MODE_DEFAULT_FG)) {
-        switch (c.fg.type) {
-        case 8: fg = zt.color8[c.fg.c8]; break;
+    if (!MODE_ISSET(s, CHAR_MODE_DEFAULT_FG)) {
+        switch (s->fg.type) {
+        case 8: fg = zt.color8[s->fg.c8]; break;
         case 24:
-            if (!(rf = xcolor_alloc(&a, c.fg.rgb[0], c.fg.rgb[1], c.fg.rgb[2])))
+            if (!(rf = xcolor_alloc(&a, s->fg.rgb[0], s->fg.rgb[1], s->fg.rgb[2])))
                 fg = a;
             break;
         }
     }
 
-    if (!MODE_ISSET(&c, CHAR_MODE_DEFAULT_BG)) {
-        switch (c.bg.type) {
-        case 8: bg = zt.color8[c.bg.c8]; break;
+    if (!MODE_ISSET(s, CHAR_MODE_DEFAULT_BG)) {
+        switch (s->bg.type) {
+        case 8: bg = zt.color8[s->bg.c8]; break;
         case 24:
-            if (!(rb = xcolor_alloc(&a, c.bg.rgb[0], c.bg.rgb[1], c.bg.rgb[2])))
+            if (!(rb = xcolor_alloc(&a, s->bg.rgb[0], s->bg.rgb[1], s->bg.rgb[2])))
                 bg = a;
             break;
         }
     }
 
-    if (MODE_ISSET(&c, CHAR_MODE_COLOR_REVERSE))
+    if (MODE_ISSET(s, CHAR_MODE_COLOR_REVERSE))
         SWAP(fg, bg);
 
     XftDrawRect(zt.draw, &bg, x, y, w, zt.fh);
-    if (MODE_ISSET(&c, CHAR_MODE_UNDERLINE))
+    if (MODE_ISSET(s, CHAR_MODE_UNDERLINE))
         XftDrawRect(zt.draw, &fg, x, y + zt.fb + 1, w, 1);
-    if (MODE_ISSET(&c, CHAR_MODE_CROSSED_OUT))
+    if (MODE_ISSET(s, CHAR_MODE_CROSSED_OUT))
         XftDrawRect(zt.draw, &fg, x, y + zt.fh / 2, w, 1);
 
     XftDrawGlyphFontSpec(zt.draw, &fg, zt.specs, zt.nspec);
@@ -152,19 +192,20 @@ xdraw_specs(struct term_char_t c) {
 
 void
 xfont_lookup(struct term_char_t c, XftFont **f, FT_UInt *idx) {
+    struct term_style_t *s = &zt.snap.style.buf[c.style];
     int i, weight, slant;
 
     weight = FC_WEIGHT_REGULAR;
     slant = FC_SLANT_ROMAN;
 
-    if (MODE_ISSET(&c, CHAR_MODE_BOLD))
+    if (MODE_ISSET(s, CHAR_MODE_BOLD))
         weight = FC_WEIGHT_BOLD;
 
     // TODO
-    if (MODE_ISSET(&c, CHAR_MODE_FAINT))
+    if (MODE_ISSET(s, CHAR_MODE_FAINT))
         weight = FC_WEIGHT_REGULAR;
 
-    if (MODE_ISSET(&c, CHAR_MODE_ITALIC))
+    if (MODE_ISSET(s, CHAR_MODE_ITALIC))
         slant = FC_SLANT_ITALIC;
 
     for (i = 0; i < zt.nfont; i++) {
@@ -182,66 +223,94 @@ xfont_lookup(struct term_char_t c, XftFont **f, FT_UInt *idx) {
     *idx = XftCharIndex(zt.dpy, *f, ' ');
 }
 
+// Redraws columns a to b of row k, widened to whole characters and
+// clipped to them
 void
-xdraw_line(int k, int y) {
+xdraw_line(int k, int y, int a, int b) {
     XRectangle r;
-    struct term_char_t c, c0;
-    int i, x;
+    struct term_char_t c, c0, *l = &zt.snap.cells[k * zt.snap.col];
+    uint32_t *u;
+    int i, j, n, x, e;
+
+    for (i = 0; i + MAX(l[i].width, 1) <= a; i += MAX(l[i].width, 1));
+    for (e = i; e < b && e < zt.snap.col; e += MAX(l[e].width, 1));
 
-    r.x = 0;
+    r.x = i * zt.fw;
     r.y = 0;
-    r.width = zt.width;
+    r.width = (e >= zt.snap.col ? zt.width : e * zt.fw) - r.x;
     r.height = zt.fh;
 
     XftDrawSetClipRectangles(zt.draw, 0, y, &r, 1);
-    //XftDrawRect(zt.draw, &zt.bkg, 0, y, zt.width, zt.fh);
-    for (i = 0, x = 0, zt.nspec = 0; i < term.col;) {
-        c = term.line[k][i];
+    for (x = i * zt.fw, zt.nspec = 0; i < e;) {
+        c = l[i];
         if (zt.nspec == 0)
             c0 = c;
 
         if (term_attr_equal(&c0, &c)) {
-            xfont_lookup(c, &zt.specs[zt.nspec].font,
-                &zt.specs[zt.nspec].glyph);
-            zt.specs[zt.nspec].x = x;
-            zt.specs[zt.nspec].y = y + zt.fb;
-            zt.nspec++;
-            i += c0.width;
-            x += c0.width * zt.fw;
+            // Combining marks are drawn over their base, without
+            // shaping only the first character of a ZWJ sequence is
+            u = term_snap_char(&zt.snap, k, &l[i], &n);
+            for (j = 0; j < n && (!j || u[j] != 0x200d); j++) {
+                c.c = u[j];
+                xfont_lookup(c, &zt.specs[zt.nspec].font,
+                    &zt.specs[zt.nspec].glyph);
+                zt.specs[zt.nspec].x = x;
+                zt.specs[zt.nspec].y = y + zt.fb;
+                zt.nspec++;
+            }
+            i += MAX(c0.width, 1);
+            x += MAX(c0.width, 1) * zt.fw;
             continue;
         }
-        xdraw_specs(c0);
+        xdraw_specs(c0, x);
     }
 
-    xdraw_specs(c0);
+    xdraw_specs(c0, x);
     XftDrawSetClip(zt.draw, 0);
 }
 
+// The cell the cursor left is drawn again to take it off
 void
 xdraw_cursor(void) {
-    static int last_y = -1;
+    static int last_x = -1, last_y = -1;
 
-    if (last_y != -1) {
-        if (last_y < term.row)
-            xdraw_line(last_y, last_y*zt.fh);
-        last_y = term.y;
-    } else {
-        last_y = term.y;
-    }
+    if (last_y != -1 && last_y < zt.snap.row && last_x < zt.snap.col)
+        xdraw_line(last_y, last_y*zt.fh, last_x, last_x+1);
+    last_x = zt.snap.x;
+    last_y = zt.snap.y;
 
-    if (MODE_ISSET(&term, MODE_CURSOR))
+    if (zt.snap.cursor)
         XftDrawRect(zt.draw, &zt.fg,
-            term.x*zt.fw, (term.y+1)*zt.fh-3, zt.fw, 3);
+            zt.snap.x*zt.fw, (zt.snap.y+1)*zt.fh-3, zt.fw, 3);
 }
 
+// The main thread takes zt.lock through here, the parser hands it over
+// between input chunks while anyone waits, see xparse_yield
+void
+xlock(void) {
+    __atomic_add_fetch(&zt.waiting, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&zt.lock);
+    __atomic_sub_fetch(&zt.waiting, 1, __ATOMIC_ACQ_REL);
+}
+
+// Only the copy of the dirty rows holds the lock, the parser goes on
+// while Xft draws the changed columns
 void
 xdraw(void) {
-    for (int i = 0, y = 0; i < term.row; i++, y += zt.fh)
-        if (term.dirty[i])
-            xdraw_line(i, y);
+    xlock();
+    // the end of the synchronized update raises the next frame
+    if (term_sync(&term) > 0) {
+        pthread_mutex_unlock(&zt.lock);
+        return;
+    }
+    term_snap(&term, &zt.snap);
+    pthread_mutex_unlock(&zt.lock);
+
+    for (int i = 0, y = 0; i < zt.snap.row; i++, y += zt.fh)
+        if (zt.snap.dirty[i].a < zt.snap.dirty[i].b)
+            xdraw_line(i, y, zt.snap.dirty[i].a, zt.snap.dirty[i].b);
     xdraw_cursor();
     xflush();
-    term_flush(&term);
 }
 
 // TODO
@@ -261,14 +330,152 @@ xkeymap(KeySym k, unsigned int state, char *buf, int *len) {
     }
 }
 
+/*
+  A drag sends a ConfigureNotify per pointer move, only the last size is
+  kept and applied with the next frame. The pixmap and the glyph specs
+  keep the largest size seen.
+*/
 void
-xresize() {
-    XFreePixmap(zt.dpy, zt.pixmap);
-    zt.pixmap = XCreatePixmap(zt.dpy, zt.window,
-        zt.width, zt.height, zt.depth);
-    XftDrawChange(zt.draw, zt.pixmap);
+xresize(void) {
+    int r, c;
+
+    zt.resize.pending = 0;
+    zt.width = zt.resize.w;
+    zt.height = zt.resize.h;
+    r = MAX(zt.height / zt.fh, 8);
+    c = MAX(zt.width / zt.fw, 8);
+
+    xlock();
+    term_resize(&term, r, c, zt.width, zt.height);
+    pthread_mutex_unlock(&zt.lock);
+
+    if (zt.width > zt.pixw || zt.height > zt.pixh) {
+        zt.pixw = MAX(zt.width, zt.pixw);
+        zt.pixh = MAX(zt.height, zt.pixh);
+        XFreePixmap(zt.dpy, zt.pixmap);
+        zt.pixmap = XCreatePixmap(zt.dpy, zt.window,
+            zt.pixw, zt.pixh, zt.depth);
+        XftDrawChange(zt.draw, zt.pixmap);
+    }
     XftDrawRect(zt.draw, &zt.bkg, 0, 0, zt.width, zt.height);
-    ASSERT(zt.specs = realloc(zt.specs, term.col*sizeof(XftGlyphFontSpec)));
+    if (c * CHAR_CLUSTER_MAX > zt.speccap) {
+        zt.speccap = c * CHAR_CLUSTER_MAX;
+        ASSERT(zt.specs = realloc(zt.specs,
+            zt.speccap * sizeof(XftGlyphFontSpec)));
+    }
+}
+
+/*
+  Pastes are requested as UTF8_STRING into ZT_PASTE on our window and
+  fed to the child through the queue in term/paste.c by xpaste_pump. A
+  plain property is read in slices; an INCR transfer only gets its next
+  chunk once the previous one is read and deleted, which is done when
+  the buffered rest is below a chunk. Memory stays bounded either way.
+*/
+enum { PASTE_IDLE, PASTE_WAIT, PASTE_PROP, PASTE_INCR, PASTE_DONE };
+
+void
+xpaste(Atom selection) {
+    if (zt.paste.state != PASTE_IDLE)
+        return;
+    XConvertSelection(zt.dpy, selection, zt.sel.utf8, zt.paste.prop,
+        zt.window, CurrentTime);
+    zt.paste.state = PASTE_WAIT;
+}
+
+static void
+xpaste_end(void) {
+    if (zt.paste.q.bracket)
+        paste_put(&zt.paste.q, (uint8_t*)"\033[201~", 6, 1);
+    zt.paste.state = PASTE_DONE;
+}
+
+void
+xpaste_pump(void) {
+    Atom type;
+    int format, incr;
+    unsigned long nitems, after;
+    uint8_t *data = NULL;
+
+    incr = zt.paste.state == PASTE_INCR;
+    if ((zt.paste.state == PASTE_PROP || (incr && zt.paste.ready)) &&
+        zt.paste.q.n < PASTE_CHUNK) {
+        // an INCR chunk has to be read whole before it is deleted
+        if (XGetWindowProperty(zt.dpy, zt.window, zt.paste.prop,
+            zt.paste.off/4, incr ? 0x1fffffff : PASTE_CHUNK/4, incr,
+            AnyPropertyType, &type, &format, &nitems, &after,
+            &data) != Success || format != 8) {
+            XDeleteProperty(zt.dpy, zt.window, zt.paste.prop);
+            xpaste_end();
+        } else if (incr) {
+            zt.paste.ready = 0;
+            paste_put(&zt.paste.q, data, nitems, 0);
+            if (!nitems)
+                xpaste_end();
+        } else {
+            zt.paste.off += nitems;
+            paste_put(&zt.paste.q, data, nitems, 0);
+            if (!after) {
+                XDeleteProperty(zt.dpy, zt.window, zt.paste.prop);
+                xpaste_end();
+            }
+        }
+        if (data)
+            XFree(data);
+    }
+
+    paste_pump(&term, &zt.paste.q);
+    if (zt.paste.state == PASTE_DONE && !zt.paste.q.n)
+        zt.paste.state = PASTE_IDLE;
+}
+
+void
+_SelectionNotify(XEvent *ev) {
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    uint8_t *data = NULL;
+
+    if (zt.paste.state != PASTE_WAIT)
+        return;
+    zt.paste.state = PASTE_IDLE;
+    if (ev->xselection.property == None)
+        return;
+
+    // only the type is looked at here, xpaste_pump reads the text
+    XGetWindowProperty(zt.dpy, zt.window, zt.paste.prop, 0, 0, False,
+        AnyPropertyType, &type, &format, &nitems, &after, &data);
+    if (data)
+        XFree(data);
+    zt.paste.q.r = zt.paste.q.n = 0;
+    zt.paste.off = zt.paste.ready = 0;
+    zt.paste.q.bracket = MODE_ISSET(&term, MODE_BRACKETED_PASTE);
+    if (zt.paste.q.bracket)
+        paste_put(&zt.paste.q, (uint8_t*)"\033[200~", 6, 1);
+    zt.paste.state = PASTE_PROP;
+    if (type == zt.paste.incr) {
+        // deleting the INCR property starts the transfer
+        zt.paste.state = PASTE_INCR;
+        XDeleteProperty(zt.dpy, zt.window, zt.paste.prop);
+    }
+}
+
+void
+_PropertyNotify(XEvent *ev) {
+    if (zt.paste.state == PASTE_INCR &&
+        ev->xproperty.atom == zt.paste.prop &&
+        ev->xproperty.state == PropertyNewValue)
+        zt.paste.ready = 1;
+}
+
+// Scrolls the view n lines back into the history, or forward if
+// negative
+static void
+xview(int n) {
+    if (!n)
+        return;
+    term_view(&term, term.hist.view + n);
+    __atomic_store_n(&zt.frame, 1, __ATOMIC_RELEASE);
 }
 
 // https://invisible-island.net/xterm/ctlseqs/ctlseqs.html#h2-Mouse-Tracking
@@ -280,8 +487,18 @@ _Mouse(XEvent *ev) {
     int n;
     char buf[64];
 
-    if (!MODE_ISSET(&term, MODE_MOUSE))
+    if (ev->type == ButtonPress && ev->xbutton.button == Button2 &&
+        !MODE_ISSET(&term, MODE_MOUSE_PRESS)) {
+        xpaste(XA_PRIMARY);
+        return;
+    }
+    if (!MODE_ISSET(&term, MODE_MOUSE)) {
+        if (ev->type == ButtonPress && ev->xbutton.button == Button4)
+            xview(3);
+        if (ev->type == ButtonPress && ev->xbutton.button == Button5)
+            xview(-3);
         return;
+    }
 
     m.y = ev->xbutton.y / zt.fh + 1;
     m.x = ev->xbutton.x / zt.fw + 1;
@@ -348,6 +565,69 @@ _Expose(XEvent *ev __unused) {
     xflush();
 }
 
+static void
+xsearch_title(char *status) {
+    char buf[512];
+
+    snprintf(buf, sizeof(buf), "search: %s%s", zt.search.q, status);
+    Xutf8SetWMProperties(zt.dpy, zt.window, buf, buf,
+        NULL, 0, NULL, NULL, NULL);
+}
+
+// Searches the session log backwards for what was typed, Return goes to
+// the next older match and scrolls to it if it is still in the
+// history, Escape leaves
+static void
+xsearch(KeySym ksym, char *buf, int n) {
+    char status[64] = "";
+    long line, lines;
+
+    switch (ksym) {
+    case XK_Escape:
+        zt.search.on = 0;
+        Xutf8SetWMProperties(zt.dpy, zt.window, zt.title, zt.title,
+            NULL, 0, NULL, NULL, NULL);
+        return;
+    case XK_BackSpace:
+        while (zt.search.n > 0 &&
+            (zt.search.q[--zt.search.n] & 0xc0) == 0x80);
+        zt.search.q[zt.search.n] = 0;
+        zt.search.line = -1;
+        break;
+    case XK_Return:
+    case XK_KP_Enter:
+        // called with zt.lock held, the log has its own and the parser
+        // is not held up by the scan; lines is read again after it
+        lines = log_lines(&term);
+        pthread_mutex_unlock(&zt.lock);
+        line = log_search(&term, zt.search.q, zt.search.n,
+            zt.search.line < 0 ? lines : zt.search.line);
+        xlock();
+        lines = log_lines(&term);
+        if (line < 0) {
+            snprintf(status, sizeof(status), " (not found)");
+            break;
+        }
+        zt.search.line = line;
+        if (lines - line > term.hist.n) {
+            snprintf(status, sizeof(status), " (line %ld, past the history)",
+                line+1);
+            break;
+        }
+        snprintf(status, sizeof(status), " (line %ld)", line+1);
+        xview(lines - line - term.hist.view);
+        break;
+    default:
+        if (n <= 0 || (uint8_t)buf[0] < 0x20 ||
+            zt.search.n + n >= (int)sizeof(zt.search.q))
+            return;
+        memcpy(zt.search.q + zt.search.n, buf, n);
+        zt.search.q[zt.search.n += n] = 0;
+        zt.search.line = -1;
+    }
+    xsearch_title(status);
+}
+
 void
 _KeyPress(XEvent *ev) {
     int n;
@@ -366,6 +646,33 @@ _KeyPress(XEvent *ev) {
         n = XLookupString(e, buf, sizeof(buf), &ksym, NULL);
     }
 
+    if (zt.search.on) {
+        xsearch(ksym, buf, n);
+        return;
+    }
+    if (ksym == XK_F && (e->state & ControlMask) && term.log) {
+        zt.search.on = 1;
+        zt.search.n = zt.search.q[0] = 0;
+        zt.search.line = -1;
+        xsearch_title("");
+        return;
+    }
+    if (ksym == XK_Insert && (e->state & ShiftMask)) {
+        xpaste(XA_PRIMARY);
+        return;
+    }
+    if (ksym == XK_V && (e->state & ControlMask)) {
+        xpaste(zt.sel.clipboard);
+        return;
+    }
+    if ((ksym == XK_Prior || ksym == XK_Next) && (e->state & ShiftMask)) {
+        xview(ksym == XK_Prior ? term.row : -term.row);
+        return;
+    }
+    // typing goes back to the live screen
+    if (!IsModifierKey(ksym))
+        xview(-term.hist.view);
+
     xkeymap(ksym, e->state, buf, &n);
     //dump((uint8_t*)buf, n);
     term_write(&term, buf, n);
@@ -373,23 +680,54 @@ _KeyPress(XEvent *ev) {
 
 void
 _ConfigureNotify(XEvent *ev) {
-    int w, h, r, c;
+    zt.resize.w = ev->xconfigure.width;
+    zt.resize.h = ev->xconfigure.height;
+    zt.resize.pending = zt.resize.w != zt.width ||
+        zt.resize.h != zt.height;
+    if (zt.resize.pending)
+        __atomic_store_n(&zt.frame, 1, __ATOMIC_RELEASE);
+}
 
-    w = ev->xconfigure.width;
-    h = ev->xconfigure.height;
+void
+_SelectionRequest(XEvent *ev) {
+    XSelectionRequestEvent *r = &ev->xselectionrequest;
+    XSelectionEvent e = {0};
+    Atom targets[] = {zt.sel.targets, zt.sel.utf8, XA_STRING};
+    long max;
+
+    e.type = SelectionNotify;
+    e.requestor = r->requestor;
+    e.selection = r->selection;
+    e.target = r->target;
+    e.time = r->time;
+    e.property = None;
+    if (r->property == None)
+        r->property = r->target;
+
+    // requests over the server limit would need INCR, they are refused
+    max = XExtendedMaxRequestSize(zt.dpy);
+    max = (max ? max : XMaxRequestSize(zt.dpy)) * 4 - 64;
+    if (r->target == zt.sel.targets) {
+        XChangeProperty(zt.dpy, r->requestor, r->property, XA_ATOM, 32,
+            PropModeReplace, (uint8_t*)targets, LEN(targets));
+        e.property = r->property;
+    } else if ((r->target == zt.sel.utf8 || r->target == XA_STRING) &&
+        zt.sel.ndata <= max) {
+        XChangeProperty(zt.dpy, r->requestor, r->property, r->target, 8,
+            PropModeReplace, zt.sel.data, zt.sel.ndata);
+        e.property = r->property;
+    }
+    XSendEvent(zt.dpy, r->requestor, True, 0, (XEvent*)&e);
+}
 
-    if (w == zt.width && h == zt.height)
+void
+_SelectionClear(XEvent *ev) {
+    zt.sel.own &= ev->xselectionclear.selection == zt.sel.clipboard ? 1 : 2;
+    if (zt.sel.own)
         return;
-
-    r = h / zt.fh;
-    c = w / zt.fw;
-    r = MAX(r, 8);
-    c = MAX(c, 8);
-
-    zt.width = w;
-    zt.height = h;
-    term_resize(&term, r, c, w, h);
-    xresize();
+    free(zt.sel.data);
+    zt.sel.data = NULL;
+    zt.sel.ndata = 0;
 }
 
 #define H(type) case type: _##type(&e); break;
@@ -410,6 +748,10 @@ xevent(void) {
         H2(ButtonRelease, Mouse)
         H2(FocusIn, Focus)
         H2(FocusOut, Focus)
+        H(SelectionRequest)
+        H(SelectionClear)
+        H(SelectionNotify)
+        H(PropertyNotify)
         case MapNotify:
         case MappingNotify:
         case KeyRelease:
@@ -452,9 +794,21 @@ xfree(void) {
     for (i = 0; i < 256; i++)
         xcolor_free(&zt.color8[i]);
     free(zt.specs);
+    free(zt.sel.buf);
+    free(zt.sel.data);
+    paste_free(&zt.paste.q);
+    term_snap_free(&zt.snap);
     close(zt.xfd);
 }
 
+// The glyph cache share of each font, --font-mem over the styles of
+// every font in font_list
+static int
+xfont_glyph_mem(void) {
+    return zt.arg.font_mem > 0 ? zt.arg.font_mem / (LEN(font_list)*4) :
+        GLYPH_MEM;
+}
+
 void
 xfont_open(char *name, int size, int weight, int slant) {
     FcPattern *p, *m;
@@ -473,6 +827,11 @@ xfont_open(char *name, int size, int weight, int slant) {
     FcPatternAddInteger(p, FC_SLANT, slant);
 
     ASSERT(m = FcFontMatch(NULL, p, &r));
+    // Xft drops glyphs from the cache of a font over its share
+    if (zt.arg.font_mem > 0) {
+        FcPatternDel(m, XFT_MAX_GLYPH_MEMORY);
+        FcPatternAddInteger(m, XFT_MAX_GLYPH_MEMORY, xfont_glyph_mem());
+    }
     ASSERT(f = XftFontOpenPattern(zt.dpy, m));
 
     if (zt.nfont >= zt.fontcap) {
@@ -536,7 +895,8 @@ xcolor_init(void) {
     int i;
     uint8_t r, g, b;
 
-    ASSERT(zt.specs = malloc(sizeof(XftGlyphFontSpec)*term.col));
+    zt.speccap = term.col*CHAR_CLUSTER_MAX;
+    ASSERT(zt.specs = malloc(sizeof(XftGlyphFontSpec)*zt.speccap));
     for (i = 0; i < 256; i++) {
         if (i <= 15) {
             r = standard_colors[i].r;
@@ -599,6 +959,8 @@ xinit(void) {
     setlocale(LC_CTYPE, "");
     XSetLocaleModifiers("");
 
+    // OSC handlers call Xlib from the parser thread
+    ASSERT(XInitThreads());
     zt.dpy = XOpenDisplay(NULL);
     ASSERT(zt.dpy);
 
@@ -611,6 +973,11 @@ xinit(void) {
     zt.colormap = XDefaultColormap(zt.dpy, zt.screen);
     zt.depth = XDefaultDepth(zt.dpy, zt.screen);
     zt.cursor = XCreateFontCursor(zt.dpy, XC_xterm);
+    zt.sel.clipboard = XInternAtom(zt.dpy, "CLIPBOARD", False);
+    zt.sel.targets = XInternAtom(zt.dpy, "TARGETS", False);
+    zt.sel.utf8 = XInternAtom(zt.dpy, "UTF8_STRING", False);
+    zt.paste.prop = XInternAtom(zt.dpy, "ZT_PASTE", False);
+    zt.paste.incr = XInternAtom(zt.dpy, "INCR", False);
 
     ASSERT(XftColorAllocName(zt.dpy, zt.visual, zt.colormap,
         FOREGROUND, &zt.fg));
@@ -632,6 +999,7 @@ xinit(void) {
                   | ButtonReleaseMask
                   | ButtonMotionMask
                   | FocusChangeMask
+                  | PropertyChangeMask
                   ;
 
     zt.window = XCreateWindow(zt.dpy, zt.root, 0, 0, zt.width,
@@ -646,8 +1014,10 @@ xinit(void) {
     zt.gc = XCreateGC(zt.dpy, zt.root, GCGraphicsExposures, &gcvalues);
     XSetBackground(zt.dpy, zt.gc, zt.bkg.pixel);
 
+    zt.pixw = zt.width;
+    zt.pixh = zt.height;
     zt.pixmap = XCreatePixmap(zt.dpy, zt.window,
-        zt.width, zt.height, zt.depth);
+        zt.pixw, zt.pixh, zt.depth);
     zt.draw = XftDrawCreate(zt.dpy, zt.pixmap,
         zt.visual, zt.colormap);
     XftDrawRect(zt.draw, &zt.bkg, 0, 0, zt.width, zt.height);
@@ -666,63 +1036,349 @@ xinit(void) {
     }
 }
 
+// OSC 0 and 2, the title is truncated rather than buffered in full
+void
+xtitle(struct term_t *t __unused, int ev, uint8_t *buf, int n) {
+    static char title[256];
+    static int len;
+
+    switch (ev) {
+    case STR_BEGIN: len = 0; break;
+    case STR_DATA:
+        n = MIN(n, (int)sizeof(title)-1-len);
+        memcpy(title+len, buf, n);
+        len += n;
+        break;
+    case STR_END:
+        title[len] = 0;
+        // kept for after a search, which has the title meanwhile
+        memcpy(zt.title, title, len+1);
+        if (!zt.search.on)
+            Xutf8SetWMProperties(zt.dpy, zt.window, title, title,
+                NULL, 0, NULL, NULL, NULL);
+        break;
+    }
+}
+
+static int
+xclip_decode(uint8_t *p, int n) {
+    int m, k;
+
+    if (zt.sel.n + n/4*3 > zt.sel.size) {
+        zt.sel.size = MAX(zt.sel.size*2, zt.sel.n + n/4*3);
+        ASSERT(zt.sel.buf = realloc(zt.sel.buf, zt.sel.size));
+    }
+    m = simd_base64_decode(p, n, zt.sel.buf + zt.sel.n, &k);
+    zt.sel.n += k;
+    return m;
+}
+
+/*
+  OSC 52 Pc;Pd, Pd is decoded chunk by chunk, a quad split between
+  chunks waits in sel.q. Queries and malformed data are ignored.
+  bit 0 of want/own is PRIMARY, bit 1 CLIPBOARD.
+*/
+void
+xclip(struct term_t *t __unused, int ev, uint8_t *buf, int n) {
+    int m;
+
+    switch (ev) {
+    case STR_BEGIN:
+        zt.sel.n = zt.sel.nq = 0;
+        zt.sel.body = zt.sel.err = zt.sel.want = 0;
+        break;
+    case STR_DATA:
+        for (; !zt.sel.body && n > 0; buf++, n--) {
+            switch (*buf) {
+            case ';': zt.sel.body = 1; break;
+            case 'c': zt.sel.want |= 2; break;
+            case 'p': case 's': zt.sel.want |= 1; break;
+            }
+        }
+        if (zt.sel.err || n <= 0)
+            break;
+        if (zt.sel.nq) {
+            m = MIN(4 - zt.sel.nq, n);
+            memcpy(zt.sel.q + zt.sel.nq, buf, m);
+            zt.sel.nq += m;
+            buf += m;
+            n -= m;
+            if (zt.sel.nq < 4)
+                break;
+            zt.sel.nq = 0;
+            if (xclip_decode(zt.sel.q, 4) != 4) {
+                zt.sel.err = 1;
+                break;
+            }
+        }
+        m = xclip_decode(buf, n);
+        if ((zt.sel.nq = n - m) >= 4)
+            zt.sel.err = 1;
+        else
+            memcpy(zt.sel.q, buf + m, zt.sel.nq);
+        break;
+    case STR_END:
+        if (!zt.sel.body || zt.sel.err || zt.sel.nq)
+            break;
+        m = zt.sel.ndata;
+        SWAP(zt.sel.buf, zt.sel.data);
+        zt.sel.size = m;
+        zt.sel.ndata = zt.sel.n;
+        zt.sel.own = zt.sel.want ? zt.sel.want : 3;
+        if (zt.sel.own & 1)
+            XSetSelectionOwner(zt.dpy, XA_PRIMARY, zt.window, CurrentTime);
+        if (zt.sel.own & 2)
+            XSetSelectionOwner(zt.dpy, zt.sel.clipboard, zt.window,
+                CurrentTime);
+        break;
+    }
+}
+
+/*
+  Bytes held per part, for -stats at exit and on SIGUSR1. The pixmap
+  and the colors live in the X server, the glyph caches inside Xft
+  where only their limit is known.
+*/
+void
+xstats(void) {
+    struct term_mem_t m;
+    long total, specs, fonts, sel, hist_n, hist_max;
+    int row, col, rowcap, colcap, style_n, style_size;
+
+    // the parser thread changes all of these, they are read together
+    xlock();
+    total = term_mem(&term, &zt.snap, &m);
+    row = term.row;
+    col = term.col;
+    rowcap = term.rowcap;
+    colcap = term.colcap;
+    style_n = term.style.n;
+    style_size = term.style.size;
+    hist_n = term.hist.n;
+    hist_max = term.hist.max_mem;
+    pthread_mutex_unlock(&zt.lock);
+    specs = zt.speccap * sizeof(*zt.specs);
+    // Xft does not tell how full the glyph caches are, only their cap
+    fonts = zt.fontcap * sizeof(*zt.fonts) +
+        (long)zt.nfont * xfont_glyph_mem();
+    sel = zt.sel.size + zt.sel.ndata + zt.paste.q.size;
+    total += specs + fonts + sel;
+
+    LOG("grid     %10ld  %dx%d, %dx%d kept\n", m.grid, row, col, rowcap,
+        colcap);
+    LOG("snap     %10ld\n", m.snap);
+    LOG("style    %10ld  %d of %d\n", m.style, style_n, style_size);
+    LOG("cluster  %10ld\n", m.cluster);
+    LOG("hist     %10ld  %ld lines, %ld max\n", m.hist, hist_n, hist_max);
+    LOG("log      %10ld  %ld lines, %ld dropped\n", m.log,
+        log_lines(&term), log_dropped(&term));
+    LOG("io       %10ld\n", m.io);
+    LOG("specs    %10ld\n", specs);
+    LOG("fonts    %10ld  %d open, glyph caches at their cap of %d %s\n",
+        fonts, zt.nfont, xfont_glyph_mem(),
+        zt.arg.font_mem > 0 ? "each" : "each, the Xft default");
+    LOG("select   %10ld\n", sel);
+    LOG("total    %10ld\n", total);
+    LOG("server   %10ld  pixmap %dx%d, %d colors\n",
+        (long)zt.pixw * zt.pixh * (zt.depth > 16 ? 4 : 2),
+        zt.pixw, zt.pixh, LEN(zt.color8) + 2);
+}
+
+void
+xstats_signal(int sig __unused) {
+    int e = errno;
+
+    if (!__atomic_exchange_n(&zt.stats, 1, __ATOMIC_ACQ_REL))
+        (void)!write(zt.wake[1], "", 1);
+    errno = e;
+}
+
+// A mutex does not queue its waiters, unlocking alone lets the parser
+// take it right back. It waits until the main thread is in.
+void
+xparse_yield(struct term_t *t __unused) {
+    if (!__atomic_load_n(&zt.waiting, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_unlock(&zt.lock);
+    while (__atomic_load_n(&zt.waiting, __ATOMIC_ACQUIRE))
+        sched_yield();
+    pthread_mutex_lock(&zt.lock);
+}
+
+/*
+  The parser thread owns the tty, term is only touched with zt.lock
+  held. term_read holds it a chunk at a time, the main thread does not
+  wait out a whole read batch for a frame or a key. A read batch that
+  left something to draw raises zt.frame, the first one since the last
+  frame also writes to zt.wake. Batches inside a synchronized update
+  (mode 2026) raise nothing, its end or timeout raises one frame for
+  all of them.
+*/
+void *
+xparse(void *arg __unused) {
+    struct timespec tv;
+    fd_set fds;
+    long wait, hold = 0;
+    int ret = 0, read, out, pump;
+
+    while (!__atomic_load_n(&zt.quit, __ATOMIC_ACQUIRE)) {
+        // input left over from the last term_read is parsed right away
+        wait = term_pending(&term) ? 0 : 500 * MILLISECOND;
+        tv = to_timespec(hold ? MIN(wait, hold) : wait);
+        FD_ZERO(&fds);
+        FD_SET(term_fd(&term), &fds);
+        ASSERT(pselect(term_fd(&term)+1, &fds, NULL, NULL, &tv, NULL) >= 0);
+        read = FD_ISSET(term_fd(&term), &fds) || term_pending(&term);
+        if (!read && !hold)
+            continue;
+
+        pthread_mutex_lock(&zt.lock);
+        out = term.out.n;
+        if (read)
+            ret = term_read(&term);
+        if (term_write_pending(&term))
+            term_write_flush(&term);
+        hold = term_sync(&term);
+        // io_uring write completions land here, not in the main loop,
+        // so it is woken to pump the next paste chunk
+        pump = term.uring && zt.paste.state != PASTE_IDLE &&
+            term.out.n < out;
+        pthread_mutex_unlock(&zt.lock);
+        if (ret)
+            __atomic_store_n(&zt.quit, 1, __ATOMIC_RELEASE);
+        if (ret || (!hold &&
+            !__atomic_exchange_n(&zt.frame, 1, __ATOMIC_ACQ_REL)) || pump)
+            ASSERT(write(zt.wake[1], "", 1) == 1);
+    }
+    return NULL;
+}
+
 int
 main(int argc, char **argv) {
-    int ret, i;
+    int ret, i, pending;
     struct timespec tv;
-    long tlast = 0;
-    fd_set fds;
+    long tlast = 0, wait;
+    char buf[64];
+    fd_set fds, wfds;
     struct option opts[] = {
         {"font-size", required_argument, NULL, 1},
         {"term", required_argument, NULL, 2},
         {"debug", required_argument, NULL, 3},
         {"no-ignore", no_argument, NULL, 4},
+        {"string-max", required_argument, NULL, 5},
+        {"input-size", required_argument, NULL, 6},
+        {"io-uring", no_argument, NULL, 7},
+        {"history-lines", required_argument, NULL, 8},
+        {"history-mem", required_argument, NULL, 9},
+        {"log", required_argument, NULL, 10},
+        {"font-mem", required_argument, NULL, 11},
+        {"stats", no_argument, NULL, 12},
+        {"shm", required_argument, NULL, 13},
         {0, 0, 0, 0}
     };
 
     zt.arg.fontsize = 1;
     zt.arg.term = "xterm-256color";
+    zt.arg.hist_lines = zt.arg.hist_mem = -1;
     while ((i = getopt_long_only(argc, argv, "", opts, NULL)) != -1) {
         switch(i) {
         case 1: stod(&zt.arg.fontsize, optarg); break;
         case 2: zt.arg.term = optarg; break;
         case 3: stoi(&zt.arg.debug, optarg); break;
         case 4: zt.arg.no_ignore = 1; break;
+        case 5: stoi(&zt.arg.string_max, optarg); break;
+        case 6: stoi(&zt.arg.input_size, optarg); break;
+        case 7: zt.arg.io_uring = 1; break;
+        case 8: stoi(&zt.arg.hist_lines, optarg); break;
+        case 9: stoi(&zt.arg.hist_mem, optarg); break;
+        case 10: zt.arg.log = optarg; break;
+        case 11: stoi(&zt.arg.font_mem, optarg); break;
+        case 12: zt.arg.stats = 1; break;
+        case 13: zt.arg.shm = optarg; break;
         }
     }
 
     term_init(&term, zt.arg.term);
     term.debug = zt.arg.debug;
     term.no_ignore = zt.arg.no_ignore;
+    if (zt.arg.string_max > 0)
+        term.str.max = zt.arg.string_max;
+    if (zt.arg.input_size > 0)
+        term.in.size = zt.arg.input_size;
+    if (zt.arg.hist_lines >= 0)
+        term.hist.max = zt.arg.hist_lines;
+    if (zt.arg.hist_mem >= 0)
+        term.hist.max_mem = zt.arg.hist_mem;
+    if (zt.arg.io_uring && (ret = uring_init(&term)))
+        LOGERR("io_uring: %s, using pselect\n", strerror(ret));
+    if (zt.arg.log && (ret = log_init(&term, zt.arg.log)))
+        LOGERR("log: %s\n", strerror(ret));
+    if (zt.arg.shm && (ret = shm_init(&term, zt.arg.shm)))
+        LOGERR("shm: %s\n", strerror(ret));
 
     xinit();
+    term_osc(&term, 0, xtitle);
+    term_osc(&term, 2, xtitle);
+    term_osc(&term, 52, xclip);
 
-    tv = to_timespec(500 * MILLISECOND);
+    pthread_mutex_init(&zt.lock, NULL);
+    term.yield = xparse_yield;
+    ASSERT(!pipe(zt.wake));
+    signal(SIGUSR1, xstats_signal);
+    ASSERT(!pthread_create(&zt.parser, NULL, xparse, NULL));
 
     for (;;) {
+        xlock();
+        xpaste_pump();
+        pending = term_write_pending(&term) && !term.uring;
+        pthread_mutex_unlock(&zt.lock);
+
+        // a frame that came too soon after the last one waits the rest
+        // of LATENCY
+        wait = 500 * MILLISECOND;
+        if (__atomic_load_n(&zt.frame, __ATOMIC_ACQUIRE))
+            wait = MAX(0, LATENCY - (get_time() - tlast));
+        tv = to_timespec(wait);
         FD_ZERO(&fds);
+        FD_ZERO(&wfds);
         FD_SET(zt.xfd, &fds);
-        FD_SET(term.tty, &fds);
-        ASSERT((ret = pselect(MAX(zt.xfd, term.tty)+1, &fds, NULL, NULL,
-            &tv, NULL)) >= 0);
-        if (!ret) continue;
-
-        if (FD_ISSET(zt.xfd, &fds) && xevent())
+        FD_SET(zt.wake[0], &fds);
+        // io_uring reports finished writes on its own fd
+        if (pending)
+            FD_SET(term.tty, &wfds);
+        ASSERT(pselect(MAX(zt.xfd, MAX(zt.wake[0], term.tty))+1,
+            &fds, &wfds, NULL, &tv, NULL) >= 0);
+        if (FD_ISSET(zt.wake[0], &fds))
+            ASSERT(read(zt.wake[0], buf, sizeof(buf)) > 0);
+        if (__atomic_load_n(&zt.quit, __ATOMIC_ACQUIRE))
+            break;
+        if (__atomic_exchange_n(&zt.stats, 0, __ATOMIC_ACQ_REL))
+            xstats();
+
+        xlock();
+        ret = FD_ISSET(zt.xfd, &fds) ? xevent() : 0;
+        if (term_write_pending(&term))
+            term_write_flush(&term);
+        pthread_mutex_unlock(&zt.lock);
+        if (ret)
             break;
 
-        if (FD_ISSET(term.tty, &fds)) {
-            if (get_time() - tlast < LATENCY)
-                continue;
+        if (__atomic_load_n(&zt.frame, __ATOMIC_ACQUIRE) &&
+            get_time() - tlast >= LATENCY) {
+            __atomic_store_n(&zt.frame, 0, __ATOMIC_RELEASE);
             tlast = get_time();
-
-            if (term_read(&term))
-                break;
-
+            if (zt.resize.pending)
+                xresize();
             xdraw();
         }
-
     }
 
+    __atomic_store_n(&zt.quit, 1, __ATOMIC_RELEASE);
+    pthread_join(zt.parser, NULL);
+    if (zt.arg.stats)
+        xstats();
+    close(zt.wake[0]);
+    close(zt.wake[1]);
     xfree();
     term_free(&term);
     return 0;